@@ -0,0 +1,16 @@
+######################################################################
+# Automatically generated by qmake (2.01a) ?? 2? 23 18:25:46 2014
+######################################################################
+
+TEMPLATE = app
+TARGET = scribble
+DEPENDPATH += .
+INCLUDEPATH += .
+
+include(scribble.pri)
+
+# Input
+HEADERS += mainwindow.h
+SOURCES += main.cpp mainwindow.cpp
+RESOURCES += scribble.qrc 
+FORMS += mainwindow.ui
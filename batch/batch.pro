@@ -0,0 +1,15 @@
+######################################################################
+# Renders drawing scripts to image files without a window
+######################################################################
+
+TEMPLATE = app
+TARGET = scribble-batch
+CONFIG += console
+CONFIG -= app_bundle
+DEPENDPATH += .
+INCLUDEPATH += .
+
+include(../scribble.pri)
+
+# Input
+SOURCES += main.cpp
@@ -0,0 +1,290 @@
+#include <QtGui>
+#include <QtConcurrentMap>
+
+#include "drawcommand.h"
+#include "floodfill.h"
+#include "tiledcanvas.h"
+
+/*
+ * scribble-batch: renders drawing scripts with the same engine as the
+ * editor, without creating any widgets, several scripts at a time.
+ *
+ *   scribble-batch [-j N] [-o DIR] [--format FMT] SCRIPT...
+ *
+ * Each script becomes DIR/<script name>.FMT (next to the script and PNG
+ * by default). A script has one operation per line; # starts a comment:
+ *
+ *   size W H                      canvas size, 800 600 until set
+ *   pen COLOR WIDTH [STYLE]       solid, dash, dot, dashdot or none
+ *   brush COLOR [STYLE]           solid or none
+ *   font FAMILY SIZE
+ *   line|rect|roundrect|ellipse X1 Y1 X2 Y2
+ *   pencil X1 Y1 X2 Y2 ...        polyline through the points
+ *   text X Y WORDS...
+ *   paste X Y FILE                FILE relative to the script
+ *   fill X Y [TOLERANCE]          bucket fill with the brush color
+ *   clear
+ *
+ * Throughput over all scripts is printed when they are done. Where fonts
+ * cannot be rendered outside the GUI thread, scripts with text run one
+ * after another on it, and their text is painted without the pool.
+ */
+
+struct BatchJob
+{
+    QString script;
+    QString output;
+    QByteArray format;
+    bool hasText;
+};
+
+struct BatchResult
+{
+    QString script;
+    QString error;
+    qint64 pixels;
+};
+
+static Qt::PenStyle penStyle(const QString &name, bool *ok)
+{
+    *ok = true;
+    if (name == "solid")
+        return Qt::SolidLine;
+    if (name == "dash")
+        return Qt::DashLine;
+    if (name == "dot")
+        return Qt::DotLine;
+    if (name == "dashdot")
+        return Qt::DashDotLine;
+    if (name == "none")
+        return Qt::NoPen;
+    *ok = false;
+    return Qt::SolidLine;
+}
+
+static Shape shapeNamed(const QString &name, bool *ok)
+{
+    *ok = true;
+    if (name == "line")
+        return LINE;
+    if (name == "rect")
+        return RECT;
+    if (name == "roundrect")
+        return ROUNDRECT;
+    if (name == "ellipse")
+        return ELLIPSE;
+    if (name == "pencil")
+        return PENCIL;
+    *ok = false;
+    return LINE;
+}
+
+static bool readPoints(const QStringList &words, int first, QPolygon *points)
+{
+    if ((words.size() - first) % 2 != 0)
+        return false;
+    for (int i = first; i + 1 < words.size(); i += 2) {
+        bool okX, okY;
+        int x = words.at(i).toInt(&okX);
+        int y = words.at(i + 1).toInt(&okY);
+        if (!okX || !okY)
+            return false;
+        *points << QPoint(x, y);
+    }
+    return true;
+}
+
+static bool usesText(const QString &script)
+{
+    QFile file(script);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QStringList words = in.readLine().simplified().split(' ', QString::SkipEmptyParts);
+        if (!words.isEmpty() && words.first().toLower() == "text")
+            return true;
+    }
+    return false;
+}
+
+static BatchResult render(const BatchJob &job)
+{
+    BatchResult result;
+    result.script = job.script;
+    result.pixels = 0;
+
+    QFile file(job.script);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        result.error = file.errorString();
+        return result;
+    }
+    QDir scriptDir = QFileInfo(job.script).absoluteDir();
+
+    TiledCanvas canvas;
+    canvas.resize(QSize(800, 600));
+    QPen pen(Qt::black, 1, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+    QBrush brush(Qt::NoBrush);
+    QFont font;
+
+    QTextStream in(&file);
+    int lineNumber = 0;
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        ++lineNumber;
+        QStringList words = line.simplified().split(' ', QString::SkipEmptyParts);
+        if (words.isEmpty() || words.first().startsWith('#'))
+            continue;
+
+        QString op = words.first().toLower();
+        bool ok = true;
+        if (op == "size" && words.size() == 3) {
+            bool okHeight;
+            QSize size(words.at(1).toInt(&ok), words.at(2).toInt(&okHeight));
+            ok = ok && okHeight && !size.isEmpty();
+            if (ok)
+                canvas.resize(size);
+        } else if (op == "pen" && (words.size() == 3 || words.size() == 4)) {
+            pen.setColor(QColor(words.at(1)));
+            pen.setWidth(words.at(2).toInt(&ok));
+            if (ok && words.size() == 4)
+                pen.setStyle(penStyle(words.at(3).toLower(), &ok));
+            ok = ok && pen.color().isValid();
+        } else if (op == "brush" && (words.size() == 2 || words.size() == 3)) {
+            QColor color(words.at(1));
+            bool solid = words.size() == 2 || words.at(2).toLower() == "solid";
+            ok = color.isValid() && (solid || words.at(2).toLower() == "none");
+            brush = solid ? QBrush(color) : QBrush(color, Qt::NoBrush);
+        } else if (op == "font" && words.size() >= 3) {
+            font = QFont(QStringList(words.mid(1, words.size() - 2)).join(" "),
+                         words.last().toInt(&ok));
+        } else if (op == "text" && words.size() >= 4) {
+            DrawCommand command(TEXT);
+            command.pen = pen;
+            command.font = font;
+            command.text = line.simplified().section(' ', 3);
+            ok = readPoints(words.mid(1, 2), 0, &command.points);
+            if (ok)
+                canvas.paint(command, QRect(), !job.hasText);
+        } else if (op == "paste" && words.size() >= 4) {
+            DrawCommand command(PASTE);
+            command.image = QImage(scriptDir.filePath(line.simplified().section(' ', 3)));
+            if (command.image.format() != QImage::Format_RGB32)
+                command.image = command.image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+            ok = !command.image.isNull() && readPoints(words.mid(1, 2), 0, &command.points);
+            if (ok)
+                canvas.paint(command);
+        } else if (op == "fill" && (words.size() == 3 || words.size() == 4)) {
+            QPolygon seed;
+            int tolerance = (words.size() == 4) ? words.at(3).toInt(&ok) : 32;
+            ok = ok && readPoints(words.mid(1, 2), 0, &seed);
+            if (ok)
+                canvas.paint(FloodFill::command(canvas, seed.first(), brush.color(), tolerance));
+        } else if (op == "clear" && words.size() == 1) {
+            canvas.clear();
+        } else {
+            DrawCommand command(shapeNamed(op, &ok));
+            command.pen = pen;
+            command.brush = (command.shape == PENCIL) ? QBrush(Qt::NoBrush) : brush;
+            ok = ok && readPoints(words, 1, &command.points) && !command.points.isEmpty()
+                 && (command.shape == PENCIL || command.points.size() == 2);
+            if (ok)
+                canvas.paint(command);
+        }
+
+        if (!ok) {
+            result.error = QString("line %1: cannot read \"%2\"").arg(lineNumber).arg(line.trimmed());
+            return result;
+        }
+    }
+
+    QImageWriter writer(job.output, job.format);
+    if (!writer.write(canvas.toImage().convertToFormat(QImage::Format_RGB32))) {
+        result.error = writer.errorString();
+        return result;
+    }
+    result.pixels = qint64(canvas.width()) * canvas.height();
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    // No widgets are made, so there is no need for a display.
+    QApplication app(argc, argv, false);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    QString outputDir;
+    QByteArray format("png");
+    QStringList scripts;
+
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); ++i) {
+        QString arg = args.at(i);
+        QString value = (i + 1 < args.size()) ? args.at(i + 1) : QString();
+        if (arg == "-j" && value.toInt() > 0) {
+            QThreadPool::globalInstance()->setMaxThreadCount(value.toInt());
+            ++i;
+        } else if (arg == "-o" && !value.isEmpty()) {
+            outputDir = value;
+            ++i;
+        } else if (arg == "--format" && !value.isEmpty()) {
+            format = value.toLatin1().toLower();
+            ++i;
+        } else if (!arg.startsWith('-')) {
+            scripts << arg;
+        } else {
+            scripts.clear();
+            break;
+        }
+    }
+
+    if (scripts.isEmpty()) {
+        err << "usage: scribble-batch [-j N] [-o DIR] [--format FMT] SCRIPT...\n";
+        return 1;
+    }
+
+    bool threadedFonts = QFontDatabase::supportsThreadedFontRendering();
+    QList<BatchJob> jobs;
+    QList<BatchJob> serialJobs;
+    foreach (const QString &script, scripts) {
+        QFileInfo info(script);
+        QDir dir(outputDir.isEmpty() ? info.absolutePath() : outputDir);
+        BatchJob job;
+        job.script = script;
+        job.output = dir.filePath(info.completeBaseName() + "." + format);
+        job.format = format;
+        job.hasText = !threadedFonts && usesText(script);
+        if (job.hasText)
+            serialJobs << job;
+        else
+            jobs << job;
+    }
+
+    // Scripts run side by side on the pool; big commands inside a script
+    // share the same pool, so the cores stay busy either way.
+    QElapsedTimer timer;
+    timer.start();
+    QList<BatchResult> results = QtConcurrent::blockingMapped<QList<BatchResult> >(jobs, render);
+    foreach (const BatchJob &job, serialJobs)
+        results << render(job);
+    qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+
+    int failed = 0;
+    qint64 pixels = 0;
+    foreach (const BatchResult &result, results) {
+        if (!result.error.isEmpty()) {
+            err << result.script << ": " << result.error << "\n";
+            ++failed;
+        }
+        pixels += result.pixels;
+    }
+
+    int done = results.size() - failed;
+    out << done << " of " << results.size() << " scripts rendered in " << elapsed << " ms with "
+        << QThreadPool::globalInstance()->maxThreadCount() << " threads: "
+        << QString::number(done * 1000.0 / elapsed, 'f', 1) << " files/s, "
+        << QString::number(pixels / 1000.0 / elapsed, 'f', 1) << " Mpx/s\n";
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,13 @@
+######################################################################
+# Replays recorded input against an offscreen ScribbleArea
+######################################################################
+
+TEMPLATE = app
+TARGET = scribble-bench
+DEPENDPATH += .
+INCLUDEPATH += .
+
+include(../scribble.pri)
+
+# Input
+SOURCES += main.cpp
@@ -0,0 +1,790 @@
+#include <QtGui>
+#include <cstdlib>
+#include <new>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "floodfill.h"
+#include "kernels.h"
+#include "scribblearea.h"
+#include "tiledcanvas.h"
+
+/*
+ * scribble-bench: replays input streams against an offscreen ScribbleArea
+ * and reports per-event latency (event delivery plus the repaint it
+ * triggers), operator new calls and peak RSS.
+ *
+ *   scribble-bench [--scenario pencil|rect|paste|undo|fill]... [--size WxH]...
+ *                  [--replay FILE] [--seed N]
+ *   scribble-bench --scaling [--size WxH]...
+ *   scribble-bench --kernels [--size WxH]...
+ *   scribble-bench --fill [--size WxH]...
+ *
+ * A replay file has one command per line: "shape NAME", "press X Y",
+ * "move X Y", "release X Y", "copy", "paste", "undo N" and "redo N".
+ * NAME is any tool; "shape PASTE" pastes like "paste" and "shape FILL"
+ * makes presses bucket fill.
+ * --scaling paints large fills and pastes straight into a TiledCanvas
+ * with 1 to N pool threads and checks that every run gives the same
+ * pixels. --kernels times the blend, fill and copy kernels at every
+ * instruction set level against QPainter. --fill first checks bucket
+ * fill against a plain breadth-first fill on random canvases, then times
+ * filling an empty and a scribbled canvas against the 100 ms budget.
+ * Qt needs a display; on a headless machine run it under xvfb-run.
+ */
+
+#if __cplusplus >= 201103L
+#define BENCH_THROW_BAD_ALLOC
+#define BENCH_NOTHROW noexcept
+#else
+#define BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define BENCH_NOTHROW throw()
+#endif
+
+static qint64 allocationCount = 0;
+static qint64 allocationBytes = 0;
+
+void *operator new(size_t size) BENCH_THROW_BAD_ALLOC
+{
+    __sync_fetch_and_add(&allocationCount, 1);
+    __sync_fetch_and_add(&allocationBytes, qint64(size));
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) BENCH_THROW_BAD_ALLOC
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) BENCH_NOTHROW
+{
+    free(p);
+}
+
+void operator delete[](void *p) BENCH_NOTHROW
+{
+    free(p);
+}
+
+struct ReplayEvent
+{
+    enum Type { Press, Move, Release, SetShape, Copy, Paste, Undo, Redo };
+
+    ReplayEvent(Type type = Move, const QPoint &pos = QPoint(), int value = 0)
+        : type(type), pos(pos), value(value) {}
+
+    Type type;
+    QPoint pos;
+    int value;
+};
+
+typedef QList<ReplayEvent> EventStream;
+
+static const char *typeNames[] = {
+    "press", "move", "release", "shape", "copy", "paste", "undo", "redo"
+};
+
+static const char *shapeNames[] = {
+    "PENCIL", "LINE", "RECT", "ROUNDRECT", "ELLIPSE", "POLYGON",
+    "TEXT", "ERASER", "PIE", "CURVE", "SELECT", "PASTE", "FILL"
+};
+
+// Bucket fill has to finish within this on a 50 megapixel canvas.
+static const qint64 FillBudgetMs = 100;
+
+static QPoint randomPoint(const QSize &size)
+{
+    return QPoint(qrand() % size.width(), qrand() % size.height());
+}
+
+static QPoint clampPoint(const QPoint &p, const QSize &size)
+{
+    return QPoint(qBound(0, p.x(), size.width() - 1), qBound(0, p.y(), size.height() - 1));
+}
+
+static void addStroke(EventStream *events, const QSize &size, int moves, int step)
+{
+    QPoint pos = randomPoint(size);
+    *events << ReplayEvent(ReplayEvent::Press, pos);
+    for (int i = 0; i < moves; ++i) {
+        pos = clampPoint(pos + QPoint(qrand() % (2 * step + 1) - step,
+                                      qrand() % (2 * step + 1) - step), size);
+        *events << ReplayEvent(ReplayEvent::Move, pos);
+    }
+    *events << ReplayEvent(ReplayEvent::Release, pos);
+}
+
+static EventStream pencilScenario(const QSize &size)
+{
+    EventStream events;
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), PENCIL);
+    for (int i = 0; i < 20; ++i)
+        addStroke(&events, size, 100, 8);
+    return events;
+}
+
+static EventStream rectScenario(const QSize &size)
+{
+    EventStream events;
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), RECT);
+    for (int i = 0; i < 50; ++i) {
+        QPoint start = randomPoint(size);
+        QPoint end = randomPoint(size);
+        events << ReplayEvent(ReplayEvent::Press, start);
+        for (int j = 1; j <= 40; ++j)
+            events << ReplayEvent(ReplayEvent::Move, start + (end - start) * j / 40);
+        events << ReplayEvent(ReplayEvent::Release, end);
+    }
+    return events;
+}
+
+static EventStream pasteScenario(const QSize &size)
+{
+    EventStream events;
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), PENCIL);
+    for (int i = 0; i < 5; ++i)
+        addStroke(&events, size, 50, 16);
+
+    QPoint corner(size.width() / 3, size.height() / 3);
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), SELECT)
+           << ReplayEvent(ReplayEvent::Press, QPoint(0, 0))
+           << ReplayEvent(ReplayEvent::Move, corner)
+           << ReplayEvent(ReplayEvent::Release, corner)
+           << ReplayEvent(ReplayEvent::Copy);
+
+    // Each paste floats in the middle of the view and is dragged about;
+    // the next paste drops it.
+    QPoint center(size.width() / 2, size.height() / 2);
+    for (int i = 0; i < 10; ++i) {
+        events << ReplayEvent(ReplayEvent::Paste)
+               << ReplayEvent(ReplayEvent::Press, center);
+        QPoint pos = center;
+        for (int j = 0; j < 50; ++j) {
+            pos = clampPoint(pos + QPoint(qrand() % 21 - 10, qrand() % 21 - 10), size);
+            events << ReplayEvent(ReplayEvent::Move, pos);
+        }
+        events << ReplayEvent(ReplayEvent::Release, pos);
+    }
+    return events;
+}
+
+static EventStream undoScenario(const QSize &size)
+{
+    EventStream events;
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), PENCIL);
+    for (int i = 0; i < 200; ++i)
+        addStroke(&events, size, 10, 32);
+    for (int i = 0; i < 200; ++i)
+        events << ReplayEvent(ReplayEvent::Undo, QPoint(), 1);
+    for (int i = 0; i < 200; ++i)
+        events << ReplayEvent(ReplayEvent::Redo, QPoint(), 1);
+    return events;
+}
+
+static EventStream fillScenario(const QSize &size)
+{
+    EventStream events;
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), RECT);
+    for (int i = 0; i < 20; ++i) {
+        QPoint start = randomPoint(size);
+        events << ReplayEvent(ReplayEvent::Press, start)
+               << ReplayEvent(ReplayEvent::Move, randomPoint(size))
+               << ReplayEvent(ReplayEvent::Release, randomPoint(size));
+    }
+
+    // Each click fills whatever region it lands in, undoing every other one.
+    events << ReplayEvent(ReplayEvent::SetShape, QPoint(), FILL);
+    for (int i = 0; i < 50; ++i) {
+        QPoint pos = randomPoint(size);
+        events << ReplayEvent(ReplayEvent::Press, pos)
+               << ReplayEvent(ReplayEvent::Release, pos);
+        if (i % 2)
+            events << ReplayEvent(ReplayEvent::Undo, QPoint(), 1);
+    }
+    return events;
+}
+
+static bool parseStream(const QString &fileName, EventStream *events)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QStringList words = in.readLine().simplified().split(' ', QString::SkipEmptyParts);
+        if (words.isEmpty() || words.first().startsWith('#'))
+            continue;
+
+        QString command = words.first();
+        QPoint pos;
+        if (words.size() >= 3)
+            pos = QPoint(words.at(1).toInt(), words.at(2).toInt());
+        int count = (words.size() >= 2) ? words.at(1).toInt() : 1;
+
+        if (command == "press") {
+            *events << ReplayEvent(ReplayEvent::Press, pos);
+        } else if (command == "move") {
+            *events << ReplayEvent(ReplayEvent::Move, pos);
+        } else if (command == "release") {
+            *events << ReplayEvent(ReplayEvent::Release, pos);
+        } else if (command == "copy") {
+            *events << ReplayEvent(ReplayEvent::Copy);
+        } else if (command == "paste") {
+            *events << ReplayEvent(ReplayEvent::Paste);
+        } else if (command == "undo") {
+            *events << ReplayEvent(ReplayEvent::Undo, QPoint(), count);
+        } else if (command == "redo") {
+            *events << ReplayEvent(ReplayEvent::Redo, QPoint(), count);
+        } else if (command == "shape" && words.size() >= 2) {
+            int shape = -1;
+            for (int i = 0; i <= FILL; ++i) {
+                if (words.at(1).toUpper() == shapeNames[i])
+                    shape = i;
+            }
+            if (shape < 0)
+                return false;
+
+            // Pasting is not a tool in the editor, just the paste action.
+            if (shape == PASTE)
+                *events << ReplayEvent(ReplayEvent::Paste);
+            else
+                *events << ReplayEvent(ReplayEvent::SetShape, QPoint(), shape);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static qint64 peakRss()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return qint64(usage.ru_maxrss) * 1024;
+#endif
+    return 0;
+}
+
+static void deliver(ScribbleArea *area, const ReplayEvent &event, bool *buttonDown)
+{
+    switch (event.type)
+    {
+        case ReplayEvent::Press: {
+            QMouseEvent press(QEvent::MouseButtonPress, event.pos,
+                              Qt::LeftButton, Qt::LeftButton, Qt::NoModifier);
+            QApplication::sendEvent(area, &press);
+            *buttonDown = true;
+            break;
+        }
+        case ReplayEvent::Move: {
+            Qt::MouseButtons buttons = *buttonDown ? Qt::LeftButton : Qt::NoButton;
+            QMouseEvent move(QEvent::MouseMove, event.pos,
+                             Qt::NoButton, buttons, Qt::NoModifier);
+            QApplication::sendEvent(area, &move);
+            break;
+        }
+        case ReplayEvent::Release: {
+            QMouseEvent release(QEvent::MouseButtonRelease, event.pos,
+                                Qt::LeftButton, Qt::NoButton, Qt::NoModifier);
+            QApplication::sendEvent(area, &release);
+            *buttonDown = false;
+            break;
+        }
+        case ReplayEvent::SetShape:
+            area->setShape(Shape(event.value));
+            break;
+        case ReplayEvent::Copy:
+            area->copySelectedImage();
+            area->clearSelected(false);
+            break;
+        case ReplayEvent::Paste:
+            area->pasteClipboard();
+            break;
+        case ReplayEvent::Undo:
+            area->moveHistory(-event.value);
+            break;
+        case ReplayEvent::Redo:
+            area->moveHistory(event.value);
+            break;
+    }
+}
+
+static qint64 percentile(const QVector<qint64> &sorted, int p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    return sorted.at(qMin(sorted.size() - 1, sorted.size() * p / 100));
+}
+
+static void run(const QString &name, const EventStream &events, const QSize &size,
+                QTextStream &out)
+{
+    ScribbleArea area;
+    area.setAttribute(Qt::WA_DontShowOnScreen);
+    area.resize(size);
+    area.show();
+    QApplication::processEvents();
+
+    QMap<int, QVector<qint64> > latencies;
+    bool buttonDown = false;
+    qint64 allocationsBefore = allocationCount;
+    qint64 bytesBefore = allocationBytes;
+
+    QElapsedTimer total;
+    total.start();
+    foreach (const ReplayEvent &event, events) {
+        QElapsedTimer timer;
+        timer.start();
+        deliver(&area, event, &buttonDown);
+        QApplication::processEvents();
+        latencies[event.type].append(timer.nsecsElapsed());
+    }
+    qint64 elapsed = total.nsecsElapsed();
+
+    qint64 allocations = allocationCount - allocationsBefore;
+    qint64 bytes = allocationBytes - bytesBefore;
+
+    out << QString("%1 %2x%3: %4 events in %5 ms, %6 news (%7 KiB), peak RSS %8 MiB\n")
+           .arg(name).arg(size.width()).arg(size.height()).arg(events.size())
+           .arg(elapsed / 1000000.0, 0, 'f', 1)
+           .arg(allocations).arg(bytes / 1024)
+           .arg(peakRss() / (1024.0 * 1024.0), 0, 'f', 1);
+
+    QMap<int, QVector<qint64> >::iterator it;
+    for (it = latencies.begin(); it != latencies.end(); ++it) {
+        QVector<qint64> &samples = it.value();
+        qSort(samples);
+        out << QString("    %1 x%2  p50 %3 us  p90 %4 us  p99 %5 us  max %6 us\n")
+               .arg(typeNames[it.key()], -8).arg(samples.size(), -6)
+               .arg(percentile(samples, 50) / 1000.0, 0, 'f', 1)
+               .arg(percentile(samples, 90) / 1000.0, 0, 'f', 1)
+               .arg(percentile(samples, 99) / 1000.0, 0, 'f', 1)
+               .arg(samples.last() / 1000.0, 0, 'f', 1);
+    }
+    out.flush();
+}
+
+static quint32 canvasChecksum(const TiledCanvas &canvas)
+{
+    quint32 sum = 0;
+    for (int ty = 0; ty * TILE_SIZE < canvas.height(); ++ty) {
+        for (int tx = 0; tx * TILE_SIZE < canvas.width(); ++tx) {
+            QImage tile = canvas.tile(tx, ty);
+            if (!tile.isNull())
+                sum = sum * 31 + qChecksum(reinterpret_cast<const char *>(tile.constBits()),
+                                           tile.byteCount());
+        }
+    }
+    return sum;
+}
+
+static void scaling(const QSize &size, QTextStream &out)
+{
+    QRect rect(QPoint(0, 0), size);
+    QList<QPair<QString, DrawCommand> > commands;
+
+    DrawCommand fill(RECT);
+    fill.pen = QPen(Qt::black, 5);
+    fill.brush = QBrush(Qt::gray);
+    fill.points << rect.topLeft() << rect.bottomRight();
+    commands << qMakePair(QString("fill rect"), fill);
+
+    DrawCommand ellipse(ELLIPSE);
+    ellipse.pen = QPen(Qt::blue, 20);
+    ellipse.brush = QBrush(Qt::red, Qt::Dense4Pattern);
+    ellipse.points << rect.topLeft() << rect.bottomRight();
+    commands << qMakePair(QString("ellipse"), ellipse);
+
+    DrawCommand paste(PASTE);
+    paste.image = QImage(size / 2, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < paste.image.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(paste.image.scanLine(y));
+        for (int x = 0; x < paste.image.width(); ++x)
+            line[x] = qRgb(qrand() % 256, qrand() % 256, qrand() % 256);
+    }
+    paste.points << QPoint(size.width() / 4, size.height() / 4);
+    commands << qMakePair(QString("paste"), paste);
+
+    QThreadPool *pool = QThreadPool::globalInstance();
+    int maxThreads = QThread::idealThreadCount();
+    QList<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        threadCounts << threads;
+    threadCounts << maxThreads;
+
+    out << QString("scaling %1x%2, up to %3 threads\n")
+           .arg(size.width()).arg(size.height()).arg(maxThreads);
+
+    for (int c = 0; c < commands.size(); ++c) {
+        qint64 serial = 0;
+        quint32 reference = 0;
+        foreach (int threads, threadCounts) {
+            pool->setMaxThreadCount(threads);
+
+            // Best of three, each on a fresh canvas so tiles are allocated too.
+            qint64 best = -1;
+            quint32 checksum = 0;
+            for (int run = 0; run < 3; ++run) {
+                TiledCanvas canvas;
+                canvas.resize(size);
+                QElapsedTimer timer;
+                timer.start();
+                canvas.paint(commands[c].second);
+                qint64 elapsed = timer.nsecsElapsed();
+                if (best < 0 || elapsed < best)
+                    best = elapsed;
+                checksum = canvasChecksum(canvas);
+            }
+
+            if (threads == 1) {
+                serial = best;
+                reference = checksum;
+            }
+            out << QString("    %1 %2 threads  %3 ms  x%4  %5\n")
+                   .arg(commands[c].first, -10).arg(threads, 2)
+                   .arg(best / 1000000.0, 7, 'f', 1)
+                   .arg(double(serial) / qMax(best, qint64(1)), 0, 'f', 2)
+                   .arg(checksum == reference ? "same pixels" : "PIXELS DIFFER");
+            out.flush();
+        }
+    }
+    pool->setMaxThreadCount(maxThreads);
+}
+
+static QImage noiseImage(const QSize &size, bool translucent)
+{
+    QImage image(size, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < image.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            int a = translucent ? qrand() % 256 : 255;
+            line[x] = qRgba(qrand() % (a + 1), qrand() % (a + 1), qrand() % (a + 1), a);
+        }
+    }
+    return image;
+}
+
+static void reportKernel(QTextStream &out, const QString &name, const QString &path,
+                         qint64 nsecs, qint64 pixels, const QString &note = QString())
+{
+    out << QString("    %1 %2 %3 ms  %4 Mpix/s  %5\n")
+           .arg(name, -12).arg(path, -8)
+           .arg(nsecs / 1000000.0, 7, 'f', 2)
+           .arg(pixels * 1000.0 / qMax(nsecs, qint64(1)), 8, 'f', 0)
+           .arg(note);
+    out.flush();
+}
+
+static void kernels(const QSize &size, QTextStream &out)
+{
+    QImage src = noiseImage(size, true);
+    QImage base = noiseImage(size, false);
+    qint64 pixels = qint64(size.width()) * size.height();
+    out << QString("kernels %1x%2, best level %3\n").arg(size.width()).arg(size.height())
+           .arg(Kernels::levelName(Kernels::bestLevel()));
+
+    QList<int> alphas;
+    alphas << 255 << 128;
+    foreach (int alpha, alphas) {
+        QString name = QString("blend a=%1").arg(alpha);
+        QImage dst = base.copy();
+        QElapsedTimer timer;
+        timer.start();
+        QPainter painter(&dst);
+        painter.setOpacity(alpha / 255.0);
+        painter.drawImage(0, 0, src);
+        painter.end();
+        reportKernel(out, name, "qpainter", timer.nsecsElapsed(), pixels);
+
+        QImage reference;
+        for (int level = Kernels::Scalar; level <= Kernels::bestLevel(); ++level) {
+            Kernels::setLevel(Kernels::Level(level));
+            dst = base.copy();
+            timer.restart();
+            for (int y = 0; y < size.height(); ++y)
+                Kernels::blend(reinterpret_cast<quint32 *>(dst.scanLine(y)),
+                               reinterpret_cast<const quint32 *>(src.constScanLine(y)),
+                               size.width(), alpha);
+            qint64 elapsed = timer.nsecsElapsed();
+            if (reference.isNull())
+                reference = dst;
+            reportKernel(out, name, Kernels::levelName(Kernels::Level(level)), elapsed, pixels,
+                         dst == reference ? "same pixels" : "PIXELS DIFFER");
+        }
+    }
+
+    QImage dst = base.copy();
+    QElapsedTimer timer;
+    timer.start();
+    QPainter painter(&dst);
+    painter.fillRect(dst.rect(), Qt::white);
+    painter.end();
+    reportKernel(out, "fill", "qpainter", timer.nsecsElapsed(), pixels);
+    for (int level = Kernels::Scalar; level <= Kernels::bestLevel(); ++level) {
+        Kernels::setLevel(Kernels::Level(level));
+        timer.restart();
+        for (int y = 0; y < size.height(); ++y)
+            Kernels::fill(reinterpret_cast<quint32 *>(dst.scanLine(y)), 0xffffffff, size.width());
+        reportKernel(out, "fill", Kernels::levelName(Kernels::Level(level)),
+                     timer.nsecsElapsed(), pixels);
+    }
+
+    QImage opaque = base.convertToFormat(QImage::Format_RGB32);
+    timer.restart();
+    painter.begin(&dst);
+    painter.drawImage(0, 0, opaque);
+    painter.end();
+    reportKernel(out, "copy", "qpainter", timer.nsecsElapsed(), pixels);
+    timer.restart();
+    for (int y = 0; y < size.height(); ++y)
+        Kernels::copy(reinterpret_cast<quint32 *>(dst.scanLine(y)),
+                      reinterpret_cast<const quint32 *>(opaque.constScanLine(y)), size.width());
+    reportKernel(out, "copy", "memcpy", timer.nsecsElapsed(), pixels);
+
+    Kernels::setLevel(Kernels::bestLevel());
+}
+
+// Compares premultiplied pixels, as the fill does.
+static bool nearColor(QRgb a, QRgb b, int tolerance)
+{
+    return qAbs(qRed(a) - qRed(b)) <= tolerance && qAbs(qGreen(a) - qGreen(b)) <= tolerance
+           && qAbs(qBlue(a) - qBlue(b)) <= tolerance && qAbs(qAlpha(a) - qAlpha(b)) <= tolerance;
+}
+
+// A plain four-way breadth-first fill over the flattened pixels.
+static QVector<bool> referenceFill(const QImage &image, const QPoint &seed, int tolerance)
+{
+    int width = image.width();
+    QVector<bool> filled(width * image.height(), false);
+    const QRgb *pixels = reinterpret_cast<const QRgb *>(image.constBits());
+    QRgb color = pixels[seed.y() * width + seed.x()];
+    QVector<QPoint> queue;
+    queue << seed;
+    filled[seed.y() * width + seed.x()] = true;
+    for (int i = 0; i < queue.size(); ++i) {
+        QPoint p = queue.at(i);
+        QPoint neighbours[] = { p + QPoint(1, 0), p - QPoint(1, 0), p + QPoint(0, 1), p - QPoint(0, 1) };
+        for (int n = 0; n < 4; ++n) {
+            QPoint q = neighbours[n];
+            if (!image.rect().contains(q) || filled[q.y() * width + q.x()]
+                    || !nearColor(pixels[q.y() * width + q.x()], color, tolerance))
+                continue;
+            filled[q.y() * width + q.x()] = true;
+            queue << q;
+        }
+    }
+    return filled;
+}
+
+static void scribble(TiledCanvas *canvas, int count, int maxWidth)
+{
+    static const Qt::GlobalColor colors[] = { Qt::black, Qt::red, Qt::darkRed, Qt::white };
+    for (int i = 0; i < count; ++i) {
+        DrawCommand command(i % 2 ? LINE : RECT);
+        command.pen = QPen(QColor(colors[qrand() % 4]), 1 + qrand() % maxWidth);
+        command.brush = QBrush(Qt::NoBrush);
+        command.points << randomPoint(canvas->size()) << randomPoint(canvas->size());
+        canvas->paint(command);
+    }
+}
+
+// Checks the scanline fill against referenceFill() on random canvases.
+static int fillSelfTest(QTextStream &out)
+{
+    int failures = 0;
+    const int canvases = 40;
+    for (int i = 0; i < canvases; ++i) {
+        TiledCanvas canvas;
+        canvas.resize(QSize(64 + qrand() % 400, 64 + qrand() % 300));
+        canvas.setTransparent(i % 2);
+        scribble(&canvas, 5 + qrand() % 40, 6);
+
+        QPoint seed = randomPoint(canvas.size());
+        int tolerance = (i % 3) ? qrand() % 128 : 0;
+        DrawCommand command = FloodFill::command(canvas, seed, Qt::blue, tolerance);
+        QVector<bool> expected = referenceFill(canvas.toImage(), seed, tolerance);
+
+        QRect mask(command.points.isEmpty() ? QPoint() : command.points.first(),
+                   command.image.size());
+        int wrong = 0;
+        for (int y = 0; y < canvas.height(); ++y) {
+            for (int x = 0; x < canvas.width(); ++x) {
+                QPoint p(x, y);
+                bool got = mask.contains(p) && command.image.pixelIndex(p - mask.topLeft()) == 1;
+                if (got != expected.at(y * canvas.width() + x))
+                    ++wrong;
+            }
+        }
+        if (wrong) {
+            out << QString("    canvas %1 (%2x%3, seed %4,%5, tolerance %6): %7 pixels differ\n")
+                   .arg(i).arg(canvas.width()).arg(canvas.height())
+                   .arg(seed.x()).arg(seed.y()).arg(tolerance).arg(wrong);
+            ++failures;
+        }
+    }
+    out << QString("fill self-test: %1 of %2 random canvases match the reference\n")
+           .arg(canvases - failures).arg(canvases);
+    out.flush();
+    return failures;
+}
+
+static void fillTiming(const QSize &size, QTextStream &out)
+{
+    out << QString("fill %1x%2 (%3 Mpix), budget %4 ms\n").arg(size.width()).arg(size.height())
+           .arg(qint64(size.width()) * size.height() / 1000000.0, 0, 'f', 1).arg(FillBudgetMs);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        TiledCanvas canvas;
+        canvas.resize(size);
+        if (pass == 1)
+            scribble(&canvas, 400, 40);
+        QPoint seed = randomPoint(size);
+
+        // Best of three; painting always starts from the same canvas.
+        qint64 bestFill = -1;
+        qint64 bestPaint = -1;
+        for (int run = 0; run < 3; ++run) {
+            TiledCanvas target = canvas;
+            QElapsedTimer timer;
+            timer.start();
+            DrawCommand command = FloodFill::command(target, seed, Qt::blue, 32);
+            qint64 fill = timer.nsecsElapsed();
+            timer.restart();
+            target.paint(command);
+            qint64 paint = timer.nsecsElapsed();
+            if (bestFill < 0 || fill + paint < bestFill + bestPaint) {
+                bestFill = fill;
+                bestPaint = paint;
+            }
+        }
+
+        qint64 total = (bestFill + bestPaint) / 1000000;
+        out << QString("    %1 fill %2 ms  paint %3 ms  %4\n")
+               .arg(pass ? "scribbled" : "empty", -10)
+               .arg(bestFill / 1000000.0, 7, 'f', 1)
+               .arg(bestPaint / 1000000.0, 7, 'f', 1)
+               .arg(total <= FillBudgetMs ? "within budget" : "OVER BUDGET");
+        out.flush();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    QStringList scenarios;
+    QList<QSize> sizes;
+    QString replayFile;
+    uint seed = 1;
+    bool scalingMode = false;
+    bool kernelsMode = false;
+    bool fillMode = false;
+
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); ++i) {
+        QString arg = args.at(i);
+        QString value = (i + 1 < args.size()) ? args.at(i + 1) : QString();
+        if (arg == "--scenario") {
+            scenarios << value;
+            ++i;
+        } else if (arg == "--size") {
+            QStringList wh = value.split('x');
+            if (wh.size() == 2)
+                sizes << QSize(wh.at(0).toInt(), wh.at(1).toInt());
+            ++i;
+        } else if (arg == "--replay") {
+            replayFile = value;
+            ++i;
+        } else if (arg == "--kernels") {
+            kernelsMode = true;
+        } else if (arg == "--scaling") {
+            scalingMode = true;
+        } else if (arg == "--fill") {
+            fillMode = true;
+        } else if (arg == "--seed") {
+            seed = value.toUInt();
+            ++i;
+        } else {
+            out << "usage: scribble-bench [--scenario pencil|rect|paste|undo|fill]... "
+                   "[--size WxH]... [--replay FILE] [--seed N]\n"
+                   "       scribble-bench --scaling [--size WxH]...\n"
+                   "       scribble-bench --kernels [--size WxH]...\n"
+                   "       scribble-bench --fill [--size WxH]...\n";
+            return 1;
+        }
+    }
+
+    if (kernelsMode) {
+        qsrand(seed);
+        if (sizes.isEmpty())
+            sizes << QSize(4096, 4096);
+        foreach (const QSize &size, sizes)
+            kernels(size, out);
+        return 0;
+    }
+
+    if (fillMode) {
+        qsrand(seed);
+        if (fillSelfTest(out))
+            return 2;
+        if (sizes.isEmpty())
+            sizes << QSize(8192, 6144);
+        foreach (const QSize &size, sizes)
+            fillTiming(size, out);
+        return 0;
+    }
+
+    if (scalingMode) {
+        qsrand(seed);
+        if (sizes.isEmpty())
+            sizes << QSize(7680, 4320);
+        foreach (const QSize &size, sizes)
+            scaling(size, out);
+        return 0;
+    }
+
+    if (sizes.isEmpty())
+        sizes << QSize(800, 600) << QSize(1920, 1080) << QSize(3840, 2160);
+    if (scenarios.isEmpty() && replayFile.isEmpty())
+        scenarios << "pencil" << "rect" << "paste" << "undo" << "fill";
+
+    EventStream recorded;
+    if (!replayFile.isEmpty() && !parseStream(replayFile, &recorded)) {
+        out << "cannot parse " << replayFile << "\n";
+        return 1;
+    }
+
+    foreach (const QSize &size, sizes) {
+        if (!replayFile.isEmpty())
+            run(QFileInfo(replayFile).fileName(), recorded, size, out);
+
+        foreach (const QString &scenario, scenarios) {
+            qsrand(seed);
+            EventStream events;
+            if (scenario == "pencil")
+                events = pencilScenario(size);
+            else if (scenario == "rect")
+                events = rectScenario(size);
+            else if (scenario == "paste")
+                events = pasteScenario(size);
+            else if (scenario == "undo")
+                events = undoScenario(size);
+            else if (scenario == "fill")
+                events = fillScenario(size);
+            else {
+                out << "unknown scenario " << scenario << "\n";
+                return 1;
+            }
+            run(scenario, events, size, out);
+        }
+    }
+
+    return 0;
+}
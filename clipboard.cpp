@@ -0,0 +1,74 @@
+#include <QtGui>
+#include "clipboard.h"
+#include "profiler.h"
+#include "tiledcanvas.h"
+
+static const char *ImageMimeType = "application/x-qt-image";
+
+// Owned by QClipboard, which deletes it when anyone sets new data.
+class ClipboardData : public QMimeData
+{
+public:
+    ClipboardData(const QImage &image) : pixels(image) {}
+    ClipboardData(const TiledCanvas &source, const QRect &rect) : area(rect)
+    {
+        // Only the tiles under the selection are kept alive.
+        canvas.resize(source.size());
+        canvas.setTransparent(source.isTransparent());
+        if (area.isEmpty())
+            return;
+        for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+            for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx)
+                canvas.setTile(tx, ty, source.tile(tx, ty));
+        }
+    }
+
+    QImage image() const
+    {
+        if (pixels.isNull() && !area.isEmpty()) {
+            PROFILE_SCOPE("clipboardImage");
+            pixels = canvas.copy(area);
+            canvas.clear();
+        }
+        return pixels;
+    }
+
+    QStringList formats() const { return QStringList() << QLatin1String(ImageMimeType); }
+    bool hasFormat(const QString &mimeType) const { return mimeType == QLatin1String(ImageMimeType); }
+
+protected:
+    QVariant retrieveData(const QString &mimeType, QVariant::Type type) const
+    {
+        Q_UNUSED(type);
+        if (mimeType != QLatin1String(ImageMimeType))
+            return QVariant();
+        PROFILE_COUNT("clipboard publishes", 1);
+        return image();
+    }
+
+private:
+    mutable TiledCanvas canvas;
+    QRect area;
+    mutable QImage pixels;
+};
+
+static QPointer<ClipboardData> current;
+
+void Clipboard::setImage(const QImage &image)
+{
+    current = new ClipboardData(image);
+    qApp->clipboard()->setMimeData(current);
+}
+
+void Clipboard::setCanvas(const TiledCanvas &canvas, const QRect &rect)
+{
+    current = new ClipboardData(canvas, rect.intersected(canvas.rect()));
+    qApp->clipboard()->setMimeData(current);
+}
+
+QImage Clipboard::image()
+{
+    if (current)
+        return current->image();
+    return qApp->clipboard()->image();
+}
@@ -0,0 +1,25 @@
+#ifndef CLIPBOARD_H
+#define CLIPBOARD_H
+
+#include <QImage>
+#include <QRect>
+
+class TiledCanvas;
+
+/*
+ * The application's side of the system clipboard. Copying a selection
+ * keeps a shared reference to the canvas tiles under it; the pixels are
+ * gathered, and the tiles let go, the first time something pastes
+ * them, and only handed to the system clipboard when another application
+ * asks for them. While the clipboard still holds our data, pasting uses
+ * those pixels directly.
+ */
+class Clipboard
+{
+public:
+    static void setImage(const QImage &image);
+    static void setCanvas(const TiledCanvas &canvas, const QRect &rect);
+    static QImage image();
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+const int TILE_SIZE = 128;
+
 enum Shape {
     PENCIL,
     LINE,
@@ -12,7 +14,9 @@ enum Shape {
     ERASER,
     PIE,
     CURVE,
-    SELECT
+    SELECT,
+    PASTE,
+    FILL
 };
 
 enum Item
@@ -22,7 +26,8 @@ enum Item
    EllipseItem,
    PolygonItem,
    LineItem,
-   PixmapItem
+   PixmapItem,
+   TextItem
 };
 
 /*
@@ -0,0 +1,158 @@
+#include <QDataStream>
+#include <QFontMetrics>
+#include <QPainter>
+#include <QPainterPath>
+#include <QPainterPathStroker>
+#include "drawcommand.h"
+
+DrawCommand::DrawCommand(Shape shape)
+    : shape(shape), pen(Qt::NoPen), brush(Qt::NoBrush)
+{
+}
+
+QRect DrawCommand::boundingRect() const
+{
+    if (points.isEmpty())
+        return QRect();
+
+    switch (shape)
+    {
+        case TEXT:
+            return QFontMetrics(font).boundingRect(text)
+                   .translated(points.first()).adjusted(-2, -2, 2, 2);
+        case PASTE:
+        case FILL:
+            return QRect(points.first(), image.size());
+        default:
+            break;
+    }
+
+    // Half the pen width on each side, plus room for round caps and joins.
+    int margin = (pen.style() == Qt::NoPen) ? 1 : pen.width() / 2 + 2;
+    return points.boundingRect().adjusted(-margin, -margin, margin, margin);
+}
+
+bool DrawCommand::contains(const QPoint &pos) const
+{
+    if (!boundingRect().contains(pos))
+        return false;
+
+    QPainterPath path;
+    bool closed = true;
+    switch (shape)
+    {
+        case ERASER:
+        case PENCIL:
+            path.addPolygon(QPolygonF(points));
+            closed = false;
+            break;
+        case LINE:
+            path.moveTo(points.first());
+            path.lineTo(points.last());
+            closed = false;
+            break;
+        case SELECT:
+        case RECT:
+        case ROUNDRECT:
+            path.addRect(QRect(points.first(), points.last()).normalized());
+            break;
+        case ELLIPSE:
+            path.addEllipse(QRect(points.first(), points.last()).normalized());
+            break;
+        case FILL:
+            return image.pixelIndex(pos - points.first()) == 1;
+        default:
+            return true;
+    }
+
+    if (closed && brush.style() != Qt::NoBrush && path.contains(QPointF(pos)))
+        return true;
+    if (pen.style() == Qt::NoPen)
+        return false;
+
+    // A few pixels of slack so thin strokes are still easy to hit.
+    QPainterPathStroker stroker;
+    stroker.setWidth(pen.width() + 4);
+    return stroker.createStroke(path).contains(QPointF(pos));
+}
+
+void DrawCommand::paint(QPainter *painter) const
+{
+    if (points.isEmpty())
+        return;
+
+    painter->setPen(pen);
+    painter->setBrush(brush);
+
+    QPoint startPoint = points.first();
+    QPoint endPoint = points.last();
+    QPoint p = endPoint - startPoint;
+    switch (shape)
+    {
+        case ERASER:
+        case PENCIL:
+            if (points.size() == 1)
+                painter->drawPoint(startPoint);
+            else
+                painter->drawPolyline(points);
+            break;
+        case LINE:
+            painter->drawLine(startPoint, endPoint);
+            break;
+        case SELECT:
+            painter->drawRect(QRect(startPoint, endPoint));
+            break;
+        case RECT:
+            // A borderless, fully transparent rectangle clears to transparent.
+            if (pen.style() == Qt::NoPen && brush.style() == Qt::SolidPattern
+                    && brush.color().alpha() == 0) {
+                painter->save();
+                painter->setCompositionMode(QPainter::CompositionMode_Clear);
+                painter->drawRect(QRect(startPoint, endPoint));
+                painter->restore();
+                break;
+            }
+            painter->drawRect(QRect(startPoint, endPoint));
+            break;
+        case ROUNDRECT:
+            painter->drawRoundedRect(QRect(startPoint, endPoint),
+                                     p.x()*10/100,
+                                     p.y()*10/100       );
+            break;
+        case ELLIPSE:
+            painter->drawEllipse(QRect(startPoint, endPoint));
+            break;
+        case TEXT:
+            painter->setFont(font);
+            painter->drawText(startPoint, text);
+            break;
+        case PASTE:
+            painter->drawImage(startPoint, image);
+            break;
+        case FILL:
+            // Index 0 of the mask's color table is transparent.
+            painter->drawImage(startPoint, image);
+            break;
+        //case POLYGON:
+
+        //case CURVE:
+        //case PIE:
+        default:
+            break;
+    }
+}
+
+QDataStream &operator<<(QDataStream &out, const DrawCommand &command)
+{
+    return out << qint32(command.shape) << command.pen << command.brush << command.points
+               << command.text << command.font << command.image;
+}
+
+QDataStream &operator>>(QDataStream &in, DrawCommand &command)
+{
+    qint32 shape;
+    in >> shape >> command.pen >> command.brush >> command.points
+       >> command.text >> command.font >> command.image;
+    command.shape = Shape(shape);
+    return in;
+}
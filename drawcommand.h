@@ -0,0 +1,44 @@
+#ifndef DRAWCOMMAND_H
+#define DRAWCOMMAND_H
+
+#include <QBrush>
+#include <QFont>
+#include <QImage>
+#include <QPen>
+#include <QPolygon>
+#include <QRect>
+#include <QString>
+
+#include "common.h"
+
+class QDataStream;
+class QPainter;
+
+/*
+ * One drawing operation with everything needed to replay it: the shape,
+ * its pen and brush and the points it was dragged through. Shapes use the
+ * first and last point, PENCIL and ERASER the whole polyline, TEXT and
+ * PASTE are anchored at the first point. FILL paints the brush color
+ * through the one-bit mask in image, also anchored at the first point.
+ */
+struct DrawCommand
+{
+    DrawCommand(Shape shape = PENCIL);
+
+    QRect boundingRect() const;
+    bool contains(const QPoint &pos) const;
+    void paint(QPainter *painter) const;
+
+    Shape shape;
+    QPen pen;
+    QBrush brush;
+    QPolygon points;
+    QString text;
+    QFont font;
+    QImage image;
+};
+
+QDataStream &operator<<(QDataStream &out, const DrawCommand &command);
+QDataStream &operator>>(QDataStream &in, DrawCommand &command);
+
+#endif
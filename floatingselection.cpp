@@ -0,0 +1,121 @@
+#include <QPainter>
+#include "floatingselection.h"
+#include "profiler.h"
+
+FloatingSelection::FloatingSelection()
+{
+    clear();
+}
+
+void FloatingSelection::lift(const QImage &image, const QPoint &pos, const QRect &source)
+{
+    clear();
+    // The canvas kernels take these two formats as they are.
+    myImage = image;
+    if (myImage.format() != QImage::Format_RGB32)
+        myImage = myImage.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    myPos = pos;
+    mySource = source;
+}
+
+void FloatingSelection::clear()
+{
+    myImage = QImage();
+    mySource = QRect();
+    myPos = QPoint();
+    myScale = 1.0;
+    myAngle = 0.0;
+    cache = QImage();
+}
+
+QPointF FloatingSelection::center() const
+{
+    return QPointF(myPos) + QPointF(myImage.width(), myImage.height()) / 2;
+}
+
+void FloatingSelection::setScale(qreal scale)
+{
+    myScale = qBound(0.05, scale, 20.0);
+}
+
+void FloatingSelection::setAngle(qreal angle)
+{
+    myAngle = angle;
+}
+
+QTransform FloatingSelection::transform() const
+{
+    // Scale and rotate about the centre of the image.
+    QTransform matrix;
+    matrix.translate(myImage.width() / 2.0, myImage.height() / 2.0);
+    matrix.rotate(myAngle);
+    matrix.scale(myScale, myScale);
+    matrix.translate(-myImage.width() / 2.0, -myImage.height() / 2.0);
+    return matrix;
+}
+
+QPoint FloatingSelection::imagePos() const
+{
+    // Where QImage::transformed() puts the top-left of its result.
+    return myPos + transform().mapRect(QRectF(myImage.rect())).toAlignedRect().topLeft();
+}
+
+QPolygon FloatingSelection::outline() const
+{
+    return transform().map(QPolygonF(QRectF(myImage.rect()))).toPolygon().translated(myPos);
+}
+
+QRect FloatingSelection::boundingRect() const
+{
+    // Room for the dashed outline drawn around the image.
+    return transform().mapRect(QRectF(myImage.rect())).toAlignedRect()
+           .translated(myPos).adjusted(-1, -1, 1, 1);
+}
+
+bool FloatingSelection::contains(const QPoint &pos) const
+{
+    return isActive() && outline().containsPoint(pos, Qt::OddEvenFill);
+}
+
+const QImage &FloatingSelection::transformed(bool smooth)
+{
+    if (myScale == 1.0 && myAngle == 0.0)
+        return myImage;
+
+    // Nearest-neighbour is good enough to look at and cheap to redo.
+    if (cache.isNull() || cacheScale != myScale || cacheAngle != myAngle
+            || (smooth && !cacheSmooth)) {
+        PROFILE_SCOPE("transformSelection");
+        cache = myImage.transformed(transform(), smooth ? Qt::SmoothTransformation
+                                                        : Qt::FastTransformation);
+        if (cache.format() != QImage::Format_ARGB32_Premultiplied)
+            cache = cache.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        cacheScale = myScale;
+        cacheAngle = myAngle;
+        cacheSmooth = smooth;
+    }
+    return cache;
+}
+
+void FloatingSelection::draw(QPainter *painter, bool smooth, bool dashed)
+{
+    if (!isActive())
+        return;
+
+    painter->drawImage(imagePos(), transformed(smooth));
+
+    painter->save();
+    painter->setPen(QPen(Qt::black, 1, dashed ? Qt::DashLine : Qt::SolidLine,
+                         Qt::FlatCap, Qt::BevelJoin));
+    painter->setBrush(Qt::NoBrush);
+    painter->drawPolygon(outline());
+    painter->restore();
+}
+
+DrawCommand FloatingSelection::pasteCommand()
+{
+    DrawCommand command(PASTE);
+    command.image = transformed(true);
+    command.points << imagePos();
+    return command;
+}
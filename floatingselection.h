@@ -0,0 +1,66 @@
+#ifndef FLOATINGSELECTION_H
+#define FLOATINGSELECTION_H
+
+#include <QImage>
+#include <QPoint>
+#include <QPolygon>
+#include <QRect>
+#include <QTransform>
+
+#include "drawcommand.h"
+
+class QPainter;
+
+/*
+ * Pixels lifted off the canvas or pasted in, floating above it until they
+ * are committed. The selection can be moved, scaled and rotated about its
+ * centre without touching the canvas. The transformed image is cached, so
+ * a move only changes where the cache is drawn; scaling or rotating makes
+ * a fast nearest-neighbour preview while dragging and a smooth one once
+ * the drag ends.
+ */
+class FloatingSelection
+{
+public:
+    FloatingSelection();
+
+    void lift(const QImage &image, const QPoint &pos, const QRect &source = QRect());
+    void clear();
+    bool isActive() const { return !myImage.isNull(); }
+    bool isLifted() const { return !mySource.isNull(); }
+    QRect sourceRect() const { return mySource; }
+    QImage image() const { return myImage; }
+
+    QPoint pos() const { return myPos; }
+    QPointF center() const;
+    qreal scale() const { return myScale; }
+    qreal angle() const { return myAngle; }
+    void moveTo(const QPoint &pos) { myPos = pos; }
+    void setScale(qreal scale);
+    void setAngle(qreal angle);
+
+    QPolygon outline() const;
+    QRect boundingRect() const;
+    bool contains(const QPoint &pos) const;
+
+    void draw(QPainter *painter, bool smooth, bool dashed = true);
+    DrawCommand pasteCommand();
+
+private:
+    QTransform transform() const;
+    QPoint imagePos() const;
+    const QImage &transformed(bool smooth);
+
+    QImage myImage;
+    QRect mySource;
+    QPoint myPos;
+    qreal myScale;
+    qreal myAngle;
+
+    QImage cache;
+    qreal cacheScale;
+    qreal cacheAngle;
+    bool cacheSmooth;
+};
+
+#endif
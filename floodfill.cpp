@@ -0,0 +1,339 @@
+#include <cstring>
+#include <QByteArray>
+#include <QVector>
+#include "floodfill.h"
+#include "kernels.h"
+#include "profiler.h"
+#include "tiledcanvas.h"
+
+namespace {
+
+// Spans waiting to be scanned are capped; past that, fill() rescans the
+// filled rows for the neighbours it could not queue.
+static const int MaxSpans = 64 * 1024;
+
+// One bit per pixel of a tile.
+static const int MaskRowBytes = TILE_SIZE / 8;
+
+// A run of row y to scan, found from the run [left, right] of row y - dy.
+struct Span
+{
+    int y;
+    int left;
+    int right;
+    int dy;
+};
+
+class Filler
+{
+public:
+    Filler(const TiledCanvas &canvas, const QPoint &seed, int tolerance);
+
+    QRect fill(const QPoint &seed);
+    QImage mask(const QRect &rect) const;
+
+private:
+    const quint32 *pixel(int x, int y) const;
+    bool matches(int x, int y) const;
+    int runEnd(int x, int y, int limit, bool matching) const;
+    int runStart(int x, int y) const;
+    const uchar *filledRow(int x, int y) const;
+    bool isFilled(int x, int y) const;
+    int filledStart(int x, int y, int limit) const;
+    int filledEnd(int x, int y) const;
+    void setFilled(int y, int left, int right);
+    void push(const Span &span);
+    void scan(QRect *bounds);
+
+    int width;
+    int height;
+    int tilesX;
+    QVector<const uchar *> tileBits;
+    quint32 color;
+    int tolerance;
+    bool backgroundMatches;
+
+    // The mask is kept per tile and only for tiles the fill reaches.
+    QVector<QByteArray> filled;
+    QVector<uchar *> filledBits;
+    QVector<Span> stack;
+    bool overflowed;
+};
+
+Filler::Filler(const TiledCanvas &canvas, const QPoint &seed, int tolerance)
+    : width(canvas.width()), height(canvas.height()), tolerance(tolerance), overflowed(false)
+{
+    // The canvas does not change while filling, so its tiles can be read in place.
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tileBits.fill(0, tilesX * tilesY);
+    for (int ty = 0; ty < tilesY; ++ty) {
+        for (int tx = 0; tx < tilesX; ++tx) {
+            QImage tile = canvas.tile(tx, ty);
+            if (!tile.isNull())
+                tileBits[ty * tilesX + tx] = tile.constBits();
+        }
+    }
+
+    quint32 background = canvas.isTransparent() ? 0 : 0xffffffff;
+    color = pixel(seed.x(), seed.y()) ? *pixel(seed.x(), seed.y()) : background;
+    backgroundMatches = Kernels::match(&background, 1, color, tolerance) == 1;
+
+    filled.resize(tilesX * tilesY);
+    filledBits.fill(0, tilesX * tilesY);
+}
+
+const quint32 *Filler::pixel(int x, int y) const
+{
+    const uchar *bits = tileBits.at((y / TILE_SIZE) * tilesX + x / TILE_SIZE);
+    if (!bits)
+        return 0;
+    return reinterpret_cast<const quint32 *>(bits) + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+}
+
+bool Filler::matches(int x, int y) const
+{
+    const quint32 *p = pixel(x, y);
+    return p ? Kernels::match(p, 1, color, tolerance) == 1 : backgroundMatches;
+}
+
+// The first x from x up to limit that does not match, or with matching
+// false the first one that does.
+int Filler::runEnd(int x, int y, int limit, bool matching) const
+{
+    while (x < limit) {
+        int end = qMin(limit, (x / TILE_SIZE + 1) * TILE_SIZE);
+        const quint32 *p = pixel(x, y);
+        int count = p ? Kernels::match(p, end - x, color, tolerance, matching)
+                      : (backgroundMatches == matching ? end - x : 0);
+        x += count;
+        if (x < end)
+            return x;
+    }
+    return limit;
+}
+
+// Where the matching run through x starts; only needed at the left end of
+// a span, so a pixel at a time is fine.
+int Filler::runStart(int x, int y) const
+{
+    while (x > 0 && matches(x - 1, y))
+        --x;
+    return x;
+}
+
+// The mask bytes of the tile row holding (x, y), or 0 where nothing is filled.
+const uchar *Filler::filledRow(int x, int y) const
+{
+    const uchar *bits = filledBits.at((y / TILE_SIZE) * tilesX + x / TILE_SIZE);
+    if (!bits)
+        return 0;
+    return bits + (y % TILE_SIZE) * MaskRowBytes;
+}
+
+bool Filler::isFilled(int x, int y) const
+{
+    const uchar *row = filledRow(x, y);
+    int tx = x % TILE_SIZE;
+    return row && (row[tx >> 3] & (0x80 >> (tx & 7)));
+}
+
+// The first filled x from x up to limit, or limit.
+int Filler::filledStart(int x, int y, int limit) const
+{
+    while (x < limit) {
+        int base = x - x % TILE_SIZE;
+        int end = qMin(limit, base + TILE_SIZE) - base;
+        const uchar *row = filledRow(x, y);
+        int tx = x - base;
+        if (row) {
+            while (tx < end && (tx & 7) && !(row[tx >> 3] & (0x80 >> (tx & 7))))
+                ++tx;
+            while (tx + 8 <= end && !row[tx >> 3])
+                tx += 8;
+            while (tx < end && !(row[tx >> 3] & (0x80 >> (tx & 7))))
+                ++tx;
+        } else {
+            tx = end;
+        }
+        x = base + tx;
+        if (tx < end)
+            return x;
+    }
+    return limit;
+}
+
+// The first unfilled x from x on.
+int Filler::filledEnd(int x, int y) const
+{
+    while (x < width) {
+        int base = x - x % TILE_SIZE;
+        int end = qMin(width, base + TILE_SIZE) - base;
+        const uchar *row = filledRow(x, y);
+        if (!row)
+            return x;
+        int tx = x - base;
+        while (tx < end && (tx & 7) && (row[tx >> 3] & (0x80 >> (tx & 7))))
+            ++tx;
+        while (tx + 8 <= end && row[tx >> 3] == 0xff)
+            tx += 8;
+        while (tx < end && (row[tx >> 3] & (0x80 >> (tx & 7))))
+            ++tx;
+        x = base + tx;
+        if (tx < end)
+            return x;
+    }
+    return width;
+}
+
+void Filler::setFilled(int y, int left, int right)
+{
+    while (left <= right) {
+        int base = left - left % TILE_SIZE;
+        int last = qMin(right, base + TILE_SIZE - 1) - base;
+        int index = (y / TILE_SIZE) * tilesX + left / TILE_SIZE;
+        if (!filledBits.at(index)) {
+            filled[index].fill(0, MaskRowBytes * TILE_SIZE);
+            filledBits[index] = reinterpret_cast<uchar *>(filled[index].data());
+        }
+        uchar *line = filledBits.at(index) + (y % TILE_SIZE) * MaskRowBytes;
+
+        int x = left - base;
+        for (; x <= last && (x & 7); ++x)
+            line[x >> 3] |= 0x80 >> (x & 7);
+        if (last - x + 1 >= 8) {
+            int bytes = (last - x + 1) / 8;
+            memset(line + (x >> 3), 0xff, bytes);
+            x += bytes * 8;
+        }
+        for (; x <= last; ++x)
+            line[x >> 3] |= 0x80 >> (x & 7);
+        left = base + TILE_SIZE;
+    }
+}
+
+void Filler::push(const Span &span)
+{
+    if (stack.size() < MaxSpans)
+        stack << span;
+    else
+        overflowed = true;
+}
+
+QRect Filler::fill(const QPoint &seed)
+{
+    QRect bounds;
+    Span first = { seed.y(), seed.x(), seed.x(), 1 };
+    Span second = { seed.y() - 1, seed.x(), seed.x(), -1 };
+    push(first);
+    push(second);
+    scan(&bounds);
+
+    // Every span that was dropped borders a filled run, so queueing both
+    // neighbours of every filled run finds them again. Each overflow means
+    // many new runs were filled, so this ends.
+    while (overflowed) {
+        overflowed = false;
+        for (int y = bounds.top(); y <= bounds.bottom(); ++y) {
+            int x = filledStart(bounds.left(), y, bounds.right() + 1);
+            while (x <= bounds.right()) {
+                int end = filledEnd(x, y);
+                Span down = { y + 1, x, end - 1, 1 };
+                Span up = { y - 1, x, end - 1, -1 };
+                push(down);
+                push(up);
+                scan(&bounds);
+                x = filledStart(end, y, bounds.right() + 1);
+            }
+        }
+    }
+    return bounds;
+}
+
+void Filler::scan(QRect *bounds)
+{
+    while (!stack.isEmpty()) {
+        Span span = stack.last();
+        stack.pop_back();
+        if (span.y < 0 || span.y >= height)
+            continue;
+
+        int y = span.y;
+        int x = span.left;
+        if (matches(x, y))
+            x = runStart(x, y);
+
+        while (x <= span.right) {
+            if (isFilled(x, y)) {
+                // Runs are always filled whole, so this one is done.
+                x = filledEnd(x, y);
+                continue;
+            }
+
+            int end = runEnd(x, y, width, true);
+            if (end == x) {
+                x = runEnd(x, y, span.right + 1, false);
+                continue;
+            }
+
+            int right = end - 1;
+            setFilled(y, x, right);
+            *bounds |= QRect(x, y, end - x, 1);
+
+            // Carry on away from the parent row, and back into it only
+            // where this run reaches past the parent run.
+            Span next = { y + span.dy, x, right, span.dy };
+            push(next);
+            if (x < span.left) {
+                Span back = { y - span.dy, x, span.left - 1, -span.dy };
+                push(back);
+            }
+            if (right > span.right) {
+                Span back = { y - span.dy, span.right + 1, right, -span.dy };
+                push(back);
+            }
+            x = end;
+        }
+    }
+}
+
+QImage Filler::mask(const QRect &rect) const
+{
+    // Tiles start on whole bytes, so rows are copied rather than shifted.
+    int left = rect.left() & ~7;
+    QImage result(rect.right() - left + 1, rect.height(), QImage::Format_Mono);
+    result.fill(0);
+    for (int y = 0; y < rect.height(); ++y) {
+        uchar *line = result.scanLine(y);
+        for (int x = left; x <= rect.right(); x = x - x % TILE_SIZE + TILE_SIZE) {
+            const uchar *row = filledRow(x, rect.top() + y);
+            if (!row)
+                continue;
+            int last = qMin(rect.right(), x - x % TILE_SIZE + TILE_SIZE - 1);
+            memcpy(line + (x - left) / 8, row + (x % TILE_SIZE) / 8, (last - x) / 8 + 1);
+        }
+    }
+    return result;
+}
+
+}
+
+DrawCommand FloodFill::command(const TiledCanvas &canvas, const QPoint &seed,
+                               const QColor &color, int tolerance)
+{
+    PROFILE_SCOPE("floodFill");
+    DrawCommand command(FILL);
+    command.brush = QBrush(color);
+    if (!canvas.rect().contains(seed))
+        return command;
+
+    Filler filler(canvas, seed, tolerance);
+    QRect bounds = filler.fill(seed);
+    if (bounds.isEmpty())
+        return command;
+
+    command.image = filler.mask(bounds);
+    command.image.setColorTable(QVector<QRgb>() << 0 << color.rgba());
+    command.points << QPoint(bounds.left() & ~7, bounds.top());
+    return command;
+}
@@ -0,0 +1,25 @@
+#ifndef FLOODFILL_H
+#define FLOODFILL_H
+
+#include <QColor>
+#include <QPoint>
+
+#include "drawcommand.h"
+
+class TiledCanvas;
+
+/*
+ * Bucket fill. Finds the pixels connected to the seed whose channels are
+ * all within the tolerance of the seed pixel, one horizontal run at a
+ * time, and returns a FILL command holding them as a one-bit mask cropped
+ * to the filled area. Replaying the command paints the mask, so it does
+ * not depend on what the canvas looks like when it is replayed.
+ */
+class FloodFill
+{
+public:
+    static DrawCommand command(const TiledCanvas &canvas, const QPoint &seed,
+                               const QColor &color, int tolerance);
+};
+
+#endif
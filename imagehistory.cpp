@@ -0,0 +1,369 @@
+#include <QDataStream>
+#include <QSet>
+#include <QtConcurrentRun>
+#include "common.h"
+#include "imagehistory.h"
+#include "profiler.h"
+#include "tiledcanvas.h"
+
+// Revisions this close to the current one stay uncompressed for snappy undo.
+static const int KeepLive = 8;
+
+static const qint64 TileBytes = qint64(TILE_SIZE) * TILE_SIZE * 4;
+
+ImageHistory::ImageHistory()
+{
+    idx = 0;
+    myMemoryBudget = 192 * 1024 * 1024;
+    mySpillBudget = 64 * 1024 * 1024;
+}
+
+void ImageHistory::clear()
+{
+    revisions.clear();
+    pending.clear();
+    idx = 0;
+
+    freeSpill.clear();
+    if (spillFile.isOpen())
+        spillFile.resize(0);
+}
+
+void ImageHistory::setBudget(qint64 memoryBytes, qint64 spillBytes)
+{
+    myMemoryBudget = memoryBytes;
+    mySpillBudget = spillBytes;
+    enforceBudget();
+}
+
+void ImageHistory::touch(const TiledCanvas &canvas, const QRect &rect)
+{
+    PROFILE_SCOPE("history.touch");
+    QRect area = rect.normalized().intersected(canvas.rect());
+    if (area.isEmpty())
+        return;
+
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+            quint32 key = TiledCanvas::tileKey(tx, ty);
+            if (pending.contains(key))
+                continue;
+
+            Tile tile;
+            tile.pos = QPoint(tx, ty);
+            tile.before = canvas.tile(tx, ty);
+            pending.insert(key, tile);
+        }
+    }
+}
+
+QRect ImageHistory::revert(TiledCanvas *canvas) const
+{
+    QRect rect;
+    foreach (const Tile &tile, pending) {
+        if (canvas->tile(tile.pos.x(), tile.pos.y()).cacheKey() == tile.before.cacheKey())
+            continue;
+        canvas->setTile(tile.pos.x(), tile.pos.y(), tile.before);
+        rect |= TiledCanvas::tileRect(tile.pos.x(), tile.pos.y());
+    }
+    return rect;
+}
+
+QRect ImageHistory::discard(TiledCanvas *canvas)
+{
+    QRect rect = revert(canvas);
+    pending.clear();
+    return rect;
+}
+
+void ImageHistory::commit(const TiledCanvas &canvas)
+{
+    PROFILE_SCOPE("history.commit");
+    Revision revision;
+    TileSet::iterator it;
+    for (it = pending.begin(); it != pending.end(); ++it) {
+        Tile &tile = it.value();
+        tile.after = canvas.tile(tile.pos.x(), tile.pos.y());
+        if (tile.after.cacheKey() == tile.before.cacheKey())
+            continue;
+
+        revision.tiles.insert(it.key(), tile);
+    }
+    pending.clear();
+
+    if (revision.tiles.isEmpty())
+        return;
+
+    while (revisions.size() > idx)
+        releaseSpill(revisions.takeLast());
+    revisions.append(revision);
+    idx++;
+
+    enforceBudget();
+}
+
+QRect ImageHistory::move(TiledCanvas *canvas, int x, bool *ok)
+{
+    PROFILE_SCOPE("history.move");
+    QRect rect = discard(canvas);
+    if (ok)
+        *ok = true;
+
+    if ( (idx + x) < 0 || (idx + x) > revisions.size() )
+        return rect;
+
+    // A revision that cannot be paged in is not stepped over.
+    for (; x < 0; ++x) {
+        const TileSet *tiles = liveTiles(idx - 1);
+        if (!tiles)
+            break;
+        --idx;
+        foreach (const Tile &tile, *tiles) {
+            canvas->setTile(tile.pos.x(), tile.pos.y(), tile.before);
+            rect |= TiledCanvas::tileRect(tile.pos.x(), tile.pos.y());
+        }
+    }
+    for (; x > 0; --x) {
+        const TileSet *tiles = liveTiles(idx);
+        if (!tiles)
+            break;
+        ++idx;
+        foreach (const Tile &tile, *tiles) {
+            canvas->setTile(tile.pos.x(), tile.pos.y(), tile.after);
+            rect |= TiledCanvas::tileRect(tile.pos.x(), tile.pos.y());
+        }
+    }
+    if (ok)
+        *ok = x == 0;
+
+    enforceBudget();
+    return rect;
+}
+
+const ImageHistory::TileSet *ImageHistory::liveTiles(int i)
+{
+    Revision &revision = revisions[i];
+
+    switch (revision.state)
+    {
+        case Packing:
+            // The tiles are still here; forget the compressed copy.
+            revision.packing = QFuture<QByteArray>();
+            break;
+        case Packed:
+            revision.tiles = unpackTiles(revision.packed);
+            revision.packed.clear();
+            break;
+        case Spilled: {
+            PROFILE_COUNT("history page-ins", 1);
+            // Every revision holds a tile, so an empty set means a bad read.
+            QByteArray packed;
+            if (spillFile.seek(revision.spillOffset))
+                packed = spillFile.read(revision.spillLength);
+            TileSet tiles;
+            if (packed.size() == revision.spillLength)
+                tiles = unpackTiles(packed);
+            if (tiles.isEmpty())
+                return 0;
+            revision.tiles = tiles;
+            releaseSpill(revision);
+            break;
+        }
+        case Live:
+            break;
+    }
+    revision.state = Live;
+    return &revision.tiles;
+}
+
+void ImageHistory::enforceBudget()
+{
+    // The "after" tile of one revision is usually the "before" tile of the
+    // next, so tiles are counted once, by how many live revisions hold them.
+    QHash<qint64, int> holders;
+    qint64 packedBytes = 0;
+
+    for (int i = 0; i < revisions.size(); ++i) {
+        Revision &revision = revisions[i];
+        if (revision.state == Packing && revision.packing.isFinished()) {
+            revision.packed = revision.packing.result();
+            revision.packing = QFuture<QByteArray>();
+            revision.tiles.clear();
+            revision.state = Packed;
+        }
+
+        if (revision.state == Live || revision.state == Packing) {
+            foreach (const Tile &tile, revision.tiles) {
+                if (!tile.before.isNull())
+                    holders[tile.before.cacheKey()]++;
+                if (!tile.after.isNull())
+                    holders[tile.after.cacheKey()]++;
+            }
+        } else if (revision.state == Packed) {
+            packedBytes += revision.packed.size();
+        }
+    }
+    qint64 liveBytes = holders.size() * TileBytes;
+
+    // Oldest revisions go first; the ones around the current index stay.
+    for (int i = 0; i < revisions.size() && liveBytes > myMemoryBudget; ++i) {
+        Revision &revision = revisions[i];
+        if (revision.state != Live || qAbs(i - idx) < KeepLive)
+            continue;
+
+        revision.packing = QtConcurrent::run(packTiles, revision.tiles);
+        revision.state = Packing;
+        foreach (const Tile &tile, revision.tiles) {
+            if (!tile.before.isNull() && --holders[tile.before.cacheKey()] == 0)
+                liveBytes -= TileBytes;
+            if (!tile.after.isNull() && --holders[tile.after.cacheKey()] == 0)
+                liveBytes -= TileBytes;
+        }
+    }
+
+    for (int i = 0; i < revisions.size() && packedBytes > mySpillBudget; ++i) {
+        Revision &revision = revisions[i];
+        if (revision.state != Packed || qAbs(i - idx) < KeepLive)
+            continue;
+        if (!spillFile.isOpen() && !spillFile.open())
+            return;
+
+        PROFILE_COUNT("history spills", 1);
+        revision.spillLength = revision.packed.size();
+        revision.spillOffset = allocateSpill(revision.spillLength);
+        if (!spillFile.seek(revision.spillOffset)
+                || spillFile.write(revision.packed) != revision.spillLength) {
+            // It stays packed in memory; the space goes back to the holes.
+            releaseSpace(revision.spillOffset, revision.spillLength);
+            revision.spillLength = 0;
+            return;
+        }
+
+        packedBytes -= revision.packed.size();
+        revision.packed.clear();
+        revision.state = Spilled;
+    }
+}
+
+qint64 ImageHistory::allocateSpill(qint64 length)
+{
+    // First fit among the holes; the rest of a hole stays free.
+    QMap<qint64, qint64>::iterator it;
+    for (it = freeSpill.begin(); it != freeSpill.end(); ++it) {
+        if (it.value() < length)
+            continue;
+
+        qint64 offset = it.key();
+        qint64 rest = it.value() - length;
+        freeSpill.erase(it);
+        if (rest > 0)
+            freeSpill.insert(offset + length, rest);
+        return offset;
+    }
+    return spillFile.size();
+}
+
+void ImageHistory::releaseSpill(const Revision &revision)
+{
+    if (revision.state != Spilled || revision.spillLength == 0)
+        return;
+    releaseSpace(revision.spillOffset, revision.spillLength);
+}
+
+void ImageHistory::releaseSpace(qint64 offset, qint64 length)
+{
+    // Merge with the neighbouring holes so large spills fit again.
+    QMap<qint64, qint64>::iterator next = freeSpill.lowerBound(offset);
+    if (next != freeSpill.end() && offset + length == next.key()) {
+        length += next.value();
+        next = freeSpill.erase(next);
+    }
+    if (next != freeSpill.begin()) {
+        QMap<qint64, qint64>::iterator previous = next - 1;
+        if (previous.key() + previous.value() == offset) {
+            offset = previous.key();
+            length += previous.value();
+            freeSpill.erase(previous);
+        }
+    }
+
+    if (offset + length >= spillFile.size())
+        spillFile.resize(offset);
+    else
+        freeSpill.insert(offset, length);
+}
+
+QByteArray ImageHistory::packTiles(const TileSet &tiles)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+
+    out << qint32(tiles.size());
+    foreach (const Tile &tile, tiles) {
+        out << tile.pos;
+        const QImage *images[2] = { &tile.before, &tile.after };
+        for (int i = 0; i < 2; ++i) {
+            const QImage &image = *images[i];
+            out << bool(image.isNull());
+            if (!image.isNull())
+                out.writeRawData(reinterpret_cast<const char *>(image.constBits()),
+                                 image.byteCount());
+        }
+    }
+
+    return qCompress(data, 1);
+}
+
+ImageHistory::TileSet ImageHistory::unpackTiles(const QByteArray &packed)
+{
+    QByteArray data = qUncompress(packed);
+    QDataStream in(data);
+    TileSet tiles;
+
+    qint32 count = 0;
+    in >> count;
+    for (qint32 n = 0; n < count; ++n) {
+        Tile tile;
+        in >> tile.pos;
+        QImage *images[2] = { &tile.before, &tile.after };
+        for (int i = 0; i < 2; ++i) {
+            bool isNull;
+            in >> isNull;
+            if (isNull)
+                continue;
+
+            QImage image(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+            in.readRawData(reinterpret_cast<char *>(image.bits()), image.byteCount());
+            *images[i] = image;
+        }
+        tiles.insert(TiledCanvas::tileKey(tile.pos.x(), tile.pos.y()), tile);
+    }
+
+    return tiles;
+}
+
+qint64 ImageHistory::byteCount() const
+{
+    // Tiles shared between revisions are counted once.
+    QSet<qint64> seen;
+    qint64 bytes = 0;
+    QList<TileSet> all;
+    foreach (const Revision &revision, revisions) {
+        all.append(revision.tiles);
+        bytes += revision.packed.size();
+    }
+    all.append(pending);
+    foreach (const TileSet &tiles, all) {
+        foreach (const Tile &tile, tiles) {
+            if (!tile.before.isNull() && !seen.contains(tile.before.cacheKey())) {
+                seen.insert(tile.before.cacheKey());
+                bytes += tile.before.byteCount();
+            }
+            if (!tile.after.isNull() && !seen.contains(tile.after.cacheKey())) {
+                seen.insert(tile.after.cacheKey());
+                bytes += tile.after.byteCount();
+            }
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,95 @@
+#ifndef IMAGEHISTORY_H
+#define IMAGEHISTORY_H
+
+#include <QByteArray>
+#include <QFuture>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QMap>
+#include <QPoint>
+#include <QRect>
+#include <QTemporaryFile>
+
+class TiledCanvas;
+
+/*
+ * Undo history that only keeps the canvas tiles an edit actually touched.
+ *
+ * Before painting, callers touch() the area they are about to change; the
+ * pending tiles are turned into a revision by commit(). Tiles are implicitly
+ * shared with the canvas, so recording one costs nothing until the canvas
+ * paints over it, and the "after" tile of one revision is the "before"
+ * tile of the next revision touching the same spot. A null tile stands for
+ * a tile the canvas has not allocated yet.
+ *
+ * Once the live tiles exceed the memory budget, revisions far from the
+ * current one are compressed on a worker thread; once the compressed ones
+ * exceed the spill budget they move to a temporary file. move() pages them
+ * back in when undo or redo reaches them. Space in the file that paged-in
+ * or dropped revisions leave behind is reused by later spills, and the
+ * file shrinks when its tail is free. A revision that cannot be written
+ * stays compressed in memory; one that cannot be read back stays in the
+ * file, and move() stops in front of it and reports the failure.
+ */
+class ImageHistory
+{
+public:
+    ImageHistory();
+
+    void clear();
+    void touch(const TiledCanvas &canvas, const QRect &rect);
+    QRect revert(TiledCanvas *canvas) const;
+    QRect discard(TiledCanvas *canvas);
+    void commit(const TiledCanvas &canvas);
+    QRect move(TiledCanvas *canvas, int x, bool *ok = 0);
+
+    void setBudget(qint64 memoryBytes, qint64 spillBytes);
+    qint64 memoryBudget() const { return myMemoryBudget; }
+
+    int count() const { return revisions.size(); }
+    int index() const { return idx; }
+    qint64 byteCount() const;
+
+private:
+    struct Tile
+    {
+        QPoint pos;
+        QImage before;
+        QImage after;
+    };
+    typedef QHash<quint32, Tile> TileSet;
+
+    enum State { Live, Packing, Packed, Spilled };
+    struct Revision
+    {
+        Revision() : state(Live), spillOffset(0), spillLength(0) {}
+
+        State state;
+        TileSet tiles;
+        QFuture<QByteArray> packing;
+        QByteArray packed;
+        qint64 spillOffset;
+        int spillLength;
+    };
+
+    static QByteArray packTiles(const TileSet &tiles);
+    static TileSet unpackTiles(const QByteArray &packed);
+
+    const TileSet *liveTiles(int i);
+    void enforceBudget();
+    qint64 allocateSpill(qint64 length);
+    void releaseSpill(const Revision &revision);
+    void releaseSpace(qint64 offset, qint64 length);
+
+    QList<Revision> revisions;
+    int idx;
+    TileSet pending;
+
+    qint64 myMemoryBudget;
+    qint64 mySpillBudget;
+    QTemporaryFile spillFile;
+    QMap<qint64, qint64> freeSpill;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QPair>
+#include "common.h"
+#include "imageloader.h"
+#include "scribblefile.h"
+
+ImageLoader::ImageLoader(const QString &fileName, const QRect &visibleRect, QObject *parent)
+    : QThread(parent), myFileName(fileName), visibleRect(visibleRect),
+      ok(false), cancelled(false)
+{
+}
+
+bool ImageLoader::takeBand(int *layer, QPoint *pos, QImage *band)
+{
+    QMutexLocker locker(&mutex);
+    if (bands.isEmpty())
+        return false;
+
+    Band next = bands.takeFirst();
+    *layer = next.layer;
+    *pos = next.pos;
+    *band = next.image;
+    return true;
+}
+
+void ImageLoader::run()
+{
+    ScribbleFile native;
+    if (native.open(myFileName)) {
+        // Tiles are decoded one by one from the mapped file, visible ones
+        // of every layer first.
+        QList<QPair<int, QPoint> > rest;
+        for (int layer = 0; layer < native.layerCount(); ++layer) {
+            foreach (const QPoint &pos, native.tiles(layer)) {
+                if (cancelled)
+                    return;
+                QRect rect(pos * TILE_SIZE, QSize(TILE_SIZE, TILE_SIZE));
+                if (!rect.intersects(visibleRect)) {
+                    rest << qMakePair(layer, pos);
+                    continue;
+                }
+                addBand(layer, rect.topLeft(), native.tile(layer, pos.x(), pos.y()));
+            }
+        }
+        for (int i = 0; i < rest.size(); ++i) {
+            if (cancelled)
+                return;
+            const QPoint &pos = rest[i].second;
+            addBand(rest[i].first, pos * TILE_SIZE, native.tile(rest[i].first, pos.x(), pos.y()));
+        }
+
+        ok = true;
+        return;
+    }
+
+    QImageReader reader(myFileName);
+    QSize size = reader.size();
+
+    if (size.isValid() && reader.supportsOption(QImageIOHandler::ClipRect)) {
+        // Keep the number of bands small: every clipped read restarts the decoder.
+        int bandHeight = (size.height() / 8 + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+        foreach (const QRect &rect, bandRects(size, qMax(bandHeight, 4 * TILE_SIZE))) {
+            if (cancelled)
+                return;
+
+            QImageReader bandReader(myFileName);
+            bandReader.setClipRect(rect);
+            QImage band = bandReader.read();
+            if (band.isNull())
+                return;
+            addBand(0, rect.topLeft(), band);
+        }
+    } else {
+        QImage image = reader.read();
+        if (image.isNull())
+            return;
+
+        foreach (const QRect &rect, bandRects(image.size(), 4 * TILE_SIZE)) {
+            if (cancelled)
+                return;
+            addBand(0, rect.topLeft(), image.copy(rect));
+        }
+    }
+
+    ok = true;
+}
+
+QList<QRect> ImageLoader::bandRects(const QSize &size, int bandHeight) const
+{
+    QList<QRect> visible;
+    QList<QRect> rest;
+    for (int y = 0; y < size.height(); y += bandHeight) {
+        QRect rect(0, y, size.width(), qMin(bandHeight, size.height() - y));
+        if (rect.intersects(visibleRect))
+            visible << rect;
+        else
+            rest << rect;
+    }
+    return visible + rest;
+}
+
+void ImageLoader::addBand(int layer, const QPoint &pos, const QImage &band)
+{
+    // Convert here rather than on the GUI thread when the band is pasted.
+    QImage converted = band;
+    if (band.format() != QImage::Format_RGB32)
+        converted = band.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    Band next;
+    next.layer = layer;
+    next.pos = pos;
+    next.image = converted;
+
+    mutex.lock();
+    bands.append(next);
+    mutex.unlock();
+
+    emit bandReady();
+}
@@ -0,0 +1,57 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QPoint>
+#include <QRect>
+#include <QString>
+#include <QThread>
+
+/*
+ * Decodes an image file in horizontal bands on its own thread. Formats
+ * that support clip rects are read band by band so the whole picture is
+ * never held in memory; the others are decoded once and handed out in
+ * bands. Native .scribble files are handed out tile by tile, each with
+ * the index of its layer. Bands overlapping the visible area come first.
+ */
+class ImageLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    ImageLoader(const QString &fileName, const QRect &visibleRect, QObject *parent = 0);
+
+    QString fileName() const { return myFileName; }
+    bool succeeded() const { return ok; }
+    void cancel() { cancelled = true; }
+    bool takeBand(int *layer, QPoint *pos, QImage *band);
+
+signals:
+    void bandReady();
+
+protected:
+    void run();
+
+private:
+    QList<QRect> bandRects(const QSize &size, int bandHeight) const;
+    void addBand(int layer, const QPoint &pos, const QImage &band);
+
+    QString myFileName;
+    QRect visibleRect;
+    bool ok;
+    volatile bool cancelled;
+
+    struct Band
+    {
+        int layer;
+        QPoint pos;
+        QImage image;
+    };
+
+    QMutex mutex;
+    QList<Band> bands;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include <QImageWriter>
+#include <QPainter>
+#include "imagesaver.h"
+#include "profiler.h"
+#include "scribblefile.h"
+
+ImageSaver::ImageSaver(const TiledCanvas &canvas, const QRect &rect,
+                       const QString &fileName, const QByteArray &fileFormat,
+                       QObject *parent)
+    : QThread(parent), canvas(canvas), myCurrent(0), rect(rect),
+      myFileName(fileName), myFileFormat(fileFormat), scribbleFile(0), ok(false)
+{
+}
+
+void ImageSaver::run()
+{
+    PROFILE_SCOPE("save");
+
+    if (scribbleFile) {
+        ok = scribbleFile->save(myLayers, myCurrent, myFileName);
+        emit progress(100);
+        return;
+    }
+
+    QImage image(rect.size(), QImage::Format_RGB32);
+    if (image.isNull())
+        return;
+    image.fill(qRgb(255, 255, 255));
+    PROFILE_COUNT("canvas copies", 1);
+
+    // Flattening is the half we can measure; the encoder gives no feedback.
+    QPainter painter(&image);
+    painter.translate(-rect.topLeft());
+    int rows = (rect.height() + TILE_SIZE - 1) / TILE_SIZE;
+    for (int row = 0; row < rows; ++row) {
+        QRect band(rect.left(), rect.top() + row * TILE_SIZE, rect.width(), TILE_SIZE);
+        canvas.draw(&painter, band.intersected(rect));
+        emit progress(50 * (row + 1) / rows);
+    }
+    painter.end();
+
+    QImageWriter writer(myFileName, myFileFormat);
+    ok = writer.write(image);
+    emit progress(100);
+}
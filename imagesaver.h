@@ -0,0 +1,54 @@
+#ifndef IMAGESAVER_H
+#define IMAGESAVER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QRect>
+#include <QString>
+#include <QThread>
+
+#include "layerstack.h"
+#include "tiledcanvas.h"
+
+class ScribbleFile;
+
+/*
+ * Flattens a snapshot of the canvas and encodes it on its own thread.
+ * The snapshot shares its tiles with the live canvas, so taking it is
+ * cheap and the user can keep drawing while the file is written.
+ * Native files are not flattened; the given ScribbleFile writes the
+ * tiles of every layer and must be left alone until the thread finishes.
+ */
+class ImageSaver : public QThread
+{
+    Q_OBJECT
+
+public:
+    ImageSaver(const TiledCanvas &canvas, const QRect &rect,
+               const QString &fileName, const QByteArray &fileFormat,
+               QObject *parent = 0);
+
+    void setScribbleFile(ScribbleFile *file, const QList<Layer> &layers, int current)
+    { scribbleFile = file; myLayers = layers; myCurrent = current; }
+
+    QString fileName() const { return myFileName; }
+    bool succeeded() const { return ok; }
+
+signals:
+    void progress(int percent);
+
+protected:
+    void run();
+
+private:
+    TiledCanvas canvas;
+    QList<Layer> myLayers;
+    int myCurrent;
+    QRect rect;
+    QString myFileName;
+    QByteArray myFileFormat;
+    ScribbleFile *scribbleFile;
+    bool ok;
+};
+
+#endif
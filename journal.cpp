@@ -0,0 +1,472 @@
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <cstring>
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+#include "journal.h"
+#include "profiler.h"
+
+static const quint32 JournalMagic = 0x5343524a; // "SCRJ"
+static const quint32 JournalVersion = 3;
+
+// A fresh checkpoint keeps recovery from replaying a long tail.
+static const int CheckpointRecords = 500;
+static const qint64 CheckpointBytes = 64 * 1024 * 1024;
+
+static void writeTile(QDataStream &out, const QPoint &pos, const QImage &tile)
+{
+    out << pos << bool(tile.isNull());
+    if (!tile.isNull())
+        out << qCompress(tile.constBits(), tile.byteCount(), 1);
+}
+
+static bool readTile(QDataStream &in, QPoint *pos, QImage *tile)
+{
+    bool isNull;
+    in >> *pos >> isNull;
+    *tile = QImage();
+    if (isNull)
+        return in.status() == QDataStream::Ok;
+
+    QByteArray packed;
+    in >> packed;
+    QByteArray data = qUncompress(packed);
+    QImage image(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+    if (data.size() != image.byteCount())
+        return false;
+    memcpy(image.bits(), data.constData(), data.size());
+    *tile = image;
+    return in.status() == QDataStream::Ok;
+}
+
+static void writeTiles(QDataStream &out, const QList<QPair<QPoint, QImage> > &tiles)
+{
+    out << qint32(tiles.size());
+    for (int i = 0; i < tiles.size(); ++i)
+        writeTile(out, tiles[i].first, tiles[i].second);
+}
+
+static void readTiles(QDataStream &in, TiledCanvas *canvas)
+{
+    qint32 count;
+    in >> count;
+    QPoint pos;
+    QImage tile;
+    for (qint32 i = 0; i < count && readTile(in, &pos, &tile); ++i)
+        canvas->setTile(pos.x(), pos.y(), tile);
+}
+
+static bool syncFile(QFile *file)
+{
+    if (!file->flush())
+        return false;
+#ifdef Q_OS_UNIX
+    return ::fsync(file->handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+// Whether the process that owns a journal is still running.
+static bool processAlive(qint64 pid)
+{
+#if defined(Q_OS_UNIX)
+    return ::kill(pid_t(pid), 0) == 0 || errno == EPERM;
+#elif defined(Q_OS_WIN)
+    HANDLE process = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, DWORD(pid));
+    if (!process)
+        return false;
+    DWORD code = 0;
+    bool alive = GetExitCodeProcess(process, &code) && code == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+#else
+    Q_UNUSED(pid);
+    return false;
+#endif
+}
+
+Journal::Journal(const QString &fileName, QObject *parent)
+    : QThread(parent), myFileName(fileName), recordsSinceCheckpoint(0),
+      bytesSinceCheckpoint(0), stopping(false)
+{
+}
+
+Journal::~Journal()
+{
+    stop();
+    wait();
+}
+
+void Journal::record(const DrawCommand &command)
+{
+    Entry entry;
+    entry.kind = Command;
+    entry.command = command;
+    enqueue(entry);
+}
+
+void Journal::recordClear(const QSize &size)
+{
+    Entry entry;
+    entry.kind = Clear;
+    entry.size = size;
+    enqueue(entry);
+}
+
+void Journal::recordResize(const QSize &size)
+{
+    Entry entry;
+    entry.kind = Resize;
+    entry.size = size;
+    enqueue(entry);
+}
+
+void Journal::recordTiles(const QRect &rect, const TiledCanvas &canvas)
+{
+    if (rect.isEmpty())
+        return;
+
+    Entry entry;
+    entry.kind = Tiles;
+    entry.size = canvas.size();
+    entry.tiles = tilesIn(rect, canvas);
+    enqueue(entry);
+}
+
+void Journal::recordLayer(int index, const Layer &layer)
+{
+    // Only the settings; the pixels are in the checkpoint and the records.
+    Entry entry;
+    entry.kind = LayerState;
+    entry.current = index;
+    Layer settings = layer;
+    settings.canvas = TiledCanvas();
+    entry.layers << settings;
+    enqueue(entry);
+}
+
+void Journal::recordLayerMove(int from, int to)
+{
+    Entry entry;
+    entry.kind = LayerMove;
+    entry.current = from;
+    entry.target = to;
+    enqueue(entry);
+}
+
+bool Journal::needsCheckpoint() const
+{
+    return recordsSinceCheckpoint >= CheckpointRecords
+           || bytesSinceCheckpoint >= CheckpointBytes;
+}
+
+void Journal::checkpoint(const LayerStack &layers, const TiledCanvas &active)
+{
+    PROFILE_SCOPE("journal.checkpoint");
+    Entry entry;
+    entry.kind = Checkpoint;
+    entry.size = active.size();
+    entry.current = layers.current();
+    // The thread picks the tiles out of the snapshot and packs them.
+    entry.layers = layers.snapshot(active);
+
+    QMutexLocker locker(&mutex);
+    // Nothing queued before a checkpoint is needed once it is written.
+    queue.clear();
+    queue.append(entry);
+    recordsSinceCheckpoint = 0;
+    bytesSinceCheckpoint = 0;
+    wakeUp.wakeOne();
+}
+
+void Journal::stop()
+{
+    QMutexLocker locker(&mutex);
+    stopping = true;
+    wakeUp.wakeOne();
+}
+
+void Journal::enqueue(const Entry &entry)
+{
+    PROFILE_SCOPE("journal.record");
+    recordsSinceCheckpoint++;
+    bytesSinceCheckpoint += entry.command.image.byteCount()
+                            + entry.tiles.size() * TILE_SIZE * TILE_SIZE * 4;
+
+    QMutexLocker locker(&mutex);
+    queue.append(entry);
+    wakeUp.wakeOne();
+}
+
+QList<QPair<QPoint, QImage> > Journal::tilesIn(const QRect &rect, const TiledCanvas &canvas)
+{
+    QList<QPair<QPoint, QImage> > tiles;
+    QRect area = rect.normalized().intersected(canvas.rect());
+    if (area.isEmpty())
+        return tiles;
+
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty)
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx)
+            tiles << qMakePair(QPoint(tx, ty), canvas.tile(tx, ty));
+    return tiles;
+}
+
+void Journal::run()
+{
+    forever {
+        mutex.lock();
+        while (queue.isEmpty() && !stopping)
+            wakeUp.wait(&mutex);
+        if (queue.isEmpty()) {
+            mutex.unlock();
+            break;
+        }
+        Entry entry = queue.takeFirst();
+        mutex.unlock();
+
+        if (entry.kind == Checkpoint)
+            startFile(entry);
+        else if (file.isOpen())
+            write(entry);
+    }
+
+    file.close();
+}
+
+bool Journal::startFile(const Entry &checkpoint)
+{
+    // The old journal stays valid until the new one holds a full checkpoint.
+    // recover() prefers an intact ".new", so a crash between the remove and
+    // the rename below still finds the checkpoint.
+    file.close();
+    file.setFileName(myFileName + ".new");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QDataStream out(&file);
+    out << JournalMagic << JournalVersion;
+    if (!write(checkpoint) || !syncFile(&file)) {
+        file.close();
+        return false;
+    }
+    file.close();
+
+    QFile::remove(myFileName);
+    if (!QFile::rename(myFileName + ".new", myFileName))
+        return false;
+
+    file.setFileName(myFileName);
+    return file.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+bool Journal::write(const Entry &entry)
+{
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_4_6);
+
+    out << quint8(entry.kind);
+    if (entry.kind == Command) {
+        out << entry.command;
+    } else if (entry.kind == LayerState) {
+        const Layer &layer = entry.layers.first();
+        out << qint32(entry.current) << layer.name << double(layer.opacity)
+            << layer.visible << qint32(layer.mode);
+    } else if (entry.kind == LayerMove) {
+        out << qint32(entry.current) << qint32(entry.target);
+    } else {
+        out << entry.size;
+        if (entry.kind == Tiles)
+            writeTiles(out, entry.tiles);
+    }
+
+    if (entry.kind == Checkpoint) {
+        out << qint32(entry.layers.size()) << qint32(entry.current);
+        for (int i = 0; i < entry.layers.size(); ++i) {
+            const Layer &layer = entry.layers[i];
+            out << layer.name << double(layer.opacity) << layer.visible << qint32(layer.mode)
+                << layer.paper;
+
+            // Missing tiles are the layer's background anyway; only undo
+            // needs to record them.
+            QList<QPair<QPoint, QImage> > tiles = tilesIn(layer.canvas.rect(), layer.canvas);
+            for (int j = tiles.size() - 1; j >= 0; --j)
+                if (tiles[j].second.isNull())
+                    tiles.removeAt(j);
+            writeTiles(out, tiles);
+        }
+    }
+
+    // Records that a crash cut short fail the checksum and end recovery.
+    QDataStream frame(&file);
+    frame << payload << qChecksum(payload.constData(), payload.size());
+    return file.flush() && frame.status() == QDataStream::Ok;
+}
+
+QString Journal::fileNameFor(const QString &dir)
+{
+    return QDir(dir).filePath(QString("autosave-%1.journal")
+                              .arg(QCoreApplication::applicationPid()));
+}
+
+// The newest journal in dir left behind by a process that is gone.
+QString Journal::orphan(const QString &dir)
+{
+    QRegExp pattern("autosave-(\\d+)\\.journal(\\.new)?");
+    QStringList names = QDir(dir).entryList(QStringList() << "autosave-*.journal*",
+                                            QDir::Files, QDir::Time);
+    foreach (const QString &name, names) {
+        if (!pattern.exactMatch(name))
+            continue;
+        qint64 pid = pattern.cap(1).toLongLong();
+        if (pid != QCoreApplication::applicationPid() && !processAlive(pid))
+            return QDir(dir).filePath(QString("autosave-%1.journal").arg(pid));
+    }
+    return QString();
+}
+
+bool Journal::exists(const QString &fileName)
+{
+    return QFile::exists(fileName) || QFile::exists(fileName + ".new");
+}
+
+bool Journal::recover(const QString &fileName, QList<Layer> *layers, int *current)
+{
+    // A ".new" file is only written from a checkpoint, so when it is intact
+    // it holds everything the older file does.
+    return recoverFile(fileName + ".new", layers, current)
+           || recoverFile(fileName, layers, current);
+}
+
+void Journal::remove(const QString &fileName)
+{
+    QFile::remove(fileName);
+    QFile::remove(fileName + ".new");
+}
+
+bool Journal::recoverFile(const QString &fileName, QList<Layer> *layers, int *current)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != JournalMagic || version != JournalVersion)
+        return false;
+
+    QList<Layer> recovered;
+    int active = 0;
+    while (!in.atEnd()) {
+        QByteArray payload;
+        quint16 checksum;
+        in >> payload >> checksum;
+        if (in.status() != QDataStream::Ok
+                || checksum != qChecksum(payload.constData(), payload.size()))
+            break;
+
+        QDataStream record(payload);
+        record.setVersion(QDataStream::Qt_4_6);
+        quint8 kind;
+        record >> kind;
+
+        // Records after a checkpoint apply to the layer current at it.
+        if (kind != Checkpoint && recovered.isEmpty())
+            break;
+        TiledCanvas *canvas = recovered.isEmpty() ? 0 : &recovered[active].canvas;
+
+        if (kind == Command) {
+            DrawCommand command;
+            record >> command;
+            canvas->paint(command);
+            continue;
+        }
+
+        if (kind == LayerState) {
+            qint32 index, mode;
+            Layer settings;
+            double opacity;
+            record >> index >> settings.name >> opacity >> settings.visible >> mode;
+            if (record.status() != QDataStream::Ok || index < 0 || index >= recovered.size())
+                break;
+            recovered[index].name = settings.name;
+            recovered[index].opacity = opacity;
+            recovered[index].visible = settings.visible;
+            recovered[index].mode = QPainter::CompositionMode(mode);
+            continue;
+        }
+
+        if (kind == LayerMove) {
+            qint32 from, to;
+            record >> from >> to;
+            if (record.status() != QDataStream::Ok || from < 0 || from >= recovered.size()
+                    || to < 0 || to >= recovered.size())
+                break;
+            // The same bookkeeping as LayerStack::move().
+            recovered.move(from, to);
+            if (active == from)
+                active = to;
+            else if (from < active && to >= active)
+                active--;
+            else if (from > active && to <= active)
+                active++;
+            for (int i = 0; i < recovered.size(); ++i) {
+                recovered[i].canvas.setTransparent(i > 0);
+                if (i > 0)
+                    recovered[i].paper = false;
+            }
+            continue;
+        }
+
+        QSize size;
+        record >> size;
+        if (kind == Checkpoint) {
+            qint32 count, index;
+            record >> count >> index;
+            if (record.status() != QDataStream::Ok || count < 1 || index < 0 || index >= count)
+                break;
+
+            QList<Layer> checkpointLayers;
+            for (qint32 i = 0; i < count; ++i) {
+                Layer layer;
+                double opacity;
+                qint32 mode;
+                record >> layer.name >> opacity >> layer.visible >> mode >> layer.paper;
+                layer.opacity = opacity;
+                layer.mode = QPainter::CompositionMode(mode);
+                layer.canvas.setTransparent(i > 0);
+                layer.canvas.resize(size);
+                readTiles(record, &layer.canvas);
+                checkpointLayers << layer;
+            }
+            if (record.status() != QDataStream::Ok)
+                break;
+            recovered = checkpointLayers;
+            active = index;
+            continue;
+        }
+
+        if (kind == Clear)
+            canvas->clear();
+        canvas->resize(size);
+        if (kind == Tiles)
+            readTiles(record, canvas);
+    }
+
+    if (recovered.isEmpty())
+        return false;
+    *layers = recovered;
+    *current = active;
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QPoint>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "drawcommand.h"
+#include "layerstack.h"
+#include "tiledcanvas.h"
+
+/*
+ * Append-only autosave journal. Every committed edit is queued as a small
+ * record (the command that was drawn, or the tiles undo and redo put
+ * back) and written by this thread, so the GUI only pays for copying a
+ * few implicitly shared handles. Once needsCheckpoint() says so, and
+ * whenever another layer becomes current, the owner hands in every layer,
+ * which starts a fresh file; records after it apply to the layer that was
+ * current then. Layer settings and order changes are small records.
+ * recover() loads the last checkpoint and replays whatever intact records
+ * follow it. Each running instance keeps its own file, named after its
+ * process id; only files whose process is gone are offered for recovery.
+ */
+class Journal : public QThread
+{
+    Q_OBJECT
+
+public:
+    Journal(const QString &fileName, QObject *parent = 0);
+    ~Journal();
+
+    QString fileName() const { return myFileName; }
+
+    void record(const DrawCommand &command);
+    void recordClear(const QSize &size);
+    void recordResize(const QSize &size);
+    void recordTiles(const QRect &rect, const TiledCanvas &canvas);
+    void recordLayer(int index, const Layer &layer);
+    void recordLayerMove(int from, int to);
+    bool needsCheckpoint() const;
+    void checkpoint(const LayerStack &layers, const TiledCanvas &active);
+    void stop();
+
+    static QString fileNameFor(const QString &dir);
+    static QString orphan(const QString &dir);
+    static bool exists(const QString &fileName);
+    static bool recover(const QString &fileName, QList<Layer> *layers, int *current);
+    static void remove(const QString &fileName);
+
+protected:
+    void run();
+
+private:
+    enum Kind { Checkpoint, Command, Clear, Resize, Tiles, LayerState, LayerMove };
+    struct Entry
+    {
+        Kind kind;
+        DrawCommand command;
+        QSize size;
+        QList<QPair<QPoint, QImage> > tiles;
+        QList<Layer> layers;
+        int current;    // the layer a LayerState or LayerMove record is about
+        int target;     // where a LayerMove record moves it to
+    };
+
+    void enqueue(const Entry &entry);
+    bool write(const Entry &entry);
+    bool startFile(const Entry &checkpoint);
+    static bool recoverFile(const QString &fileName, QList<Layer> *layers, int *current);
+    static QList<QPair<QPoint, QImage> > tilesIn(const QRect &rect,
+                                                 const TiledCanvas &canvas);
+
+    QString myFileName;
+    QFile file;
+    int recordsSinceCheckpoint;
+    qint64 bytesSinceCheckpoint;
+
+    QMutex mutex;
+    QWaitCondition wakeUp;
+    QList<Entry> queue;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,298 @@
+#include <cstring>
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#define KERNELS_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+typedef void (*BlendFunc)(quint32 *, const quint32 *, int, int);
+typedef void (*FillFunc)(quint32 *, quint32, int);
+typedef int (*MatchFunc)(const quint32 *, int, quint32, int, bool);
+
+// x * a / 255, rounded, on the two bytes of x held in 0x00ff00ff lanes.
+static inline quint32 mulLanes(quint32 x, quint32 a)
+{
+    quint32 t = (x & 0x00ff00ff) * a + 0x00800080;
+    return ((t + ((t >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+}
+
+static inline quint32 byteMul(quint32 x, quint32 a)
+{
+    return mulLanes(x, a) | (mulLanes(x >> 8, a) << 8);
+}
+
+static void blendScalar(quint32 *dst, const quint32 *src, int count, int alpha)
+{
+    for (int i = 0; i < count; ++i) {
+        quint32 s = (alpha == 255) ? src[i] : byteMul(src[i], alpha);
+        quint32 sa = s >> 24;
+        if (sa == 255)
+            dst[i] = s;
+        else if (s != 0)
+            dst[i] = s + byteMul(dst[i], 255 - sa);
+    }
+}
+
+static void fillScalar(quint32 *dst, quint32 color, int count)
+{
+    for (int i = 0; i < count; ++i)
+        dst[i] = color;
+}
+
+static inline bool near(quint32 a, quint32 b, int tolerance)
+{
+    for (int shift = 0; shift < 32; shift += 8) {
+        int d = int((a >> shift) & 0xff) - int((b >> shift) & 0xff);
+        if (d > tolerance || d < -tolerance)
+            return false;
+    }
+    return true;
+}
+
+static int matchScalar(const quint32 *src, int count, quint32 color, int tolerance, bool matching)
+{
+    int i = 0;
+    while (i < count && near(src[i], color, tolerance) == matching)
+        ++i;
+    return i;
+}
+
+#ifdef KERNELS_X86
+// The same rounding as mulLanes(), on eight 16-bit channels.
+KERNELS_TARGET("sse2")
+static inline __m128i mul128(__m128i x, __m128i a)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, a), _mm_set1_epi16(0x80));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+KERNELS_TARGET("sse2")
+static inline __m128i blend128(__m128i s, __m128i d, __m128i alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(0xff);
+
+    __m128i sLo = mul128(_mm_unpacklo_epi8(s, zero), alpha);
+    __m128i sHi = mul128(_mm_unpackhi_epi8(s, zero), alpha);
+    __m128i invLo = _mm_sub_epi16(full, _mm_shufflehi_epi16(
+                                  _mm_shufflelo_epi16(sLo, 0xff), 0xff));
+    __m128i invHi = _mm_sub_epi16(full, _mm_shufflehi_epi16(
+                                  _mm_shufflelo_epi16(sHi, 0xff), 0xff));
+    __m128i dLo = mul128(_mm_unpacklo_epi8(d, zero), invLo);
+    __m128i dHi = mul128(_mm_unpackhi_epi8(d, zero), invHi);
+    return _mm_packus_epi16(_mm_add_epi16(sLo, dLo), _mm_add_epi16(sHi, dHi));
+}
+
+KERNELS_TARGET("sse2")
+static void blendSse2(quint32 *dst, const quint32 *src, int count, int alpha)
+{
+    const __m128i a = _mm_set1_epi16(alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), blend128(s, d, a));
+    }
+    blendScalar(dst + i, src + i, count - i, alpha);
+}
+
+KERNELS_TARGET("sse2")
+static void fillSse2(quint32 *dst, quint32 color, int count)
+{
+    const __m128i c = _mm_set1_epi32(color);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), c);
+    fillScalar(dst + i, color, count - i);
+}
+
+// One bit per pixel, set where every channel is within the tolerance.
+KERNELS_TARGET("sse2")
+static inline int near128(__m128i s, __m128i c, __m128i tolerance)
+{
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(s, c), _mm_subs_epu8(c, s));
+    __m128i over = _mm_subs_epu8(diff, tolerance);
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, _mm_setzero_si128())));
+}
+
+KERNELS_TARGET("sse2")
+static int matchSse2(const quint32 *src, int count, quint32 color, int tolerance, bool matching)
+{
+    const __m128i c = _mm_set1_epi32(color);
+    const __m128i t = _mm_set1_epi8(char(tolerance));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int bits = near128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)), c, t);
+        if (matching)
+            bits = ~bits & 0xf;
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i + matchScalar(src + i, count - i, color, tolerance, matching);
+}
+
+KERNELS_TARGET("avx2")
+static inline __m256i mul256(__m256i x, __m256i a)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, a), _mm256_set1_epi16(0x80));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+KERNELS_TARGET("avx2")
+static void blendAvx2(quint32 *dst, const quint32 *src, int count, int alpha)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(0xff);
+    const __m256i a = _mm256_set1_epi16(alpha);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+
+        // Unpack and pack both work within 128-bit halves, so they cancel out.
+        __m256i sLo = mul256(_mm256_unpacklo_epi8(s, zero), a);
+        __m256i sHi = mul256(_mm256_unpackhi_epi8(s, zero), a);
+        __m256i invLo = _mm256_sub_epi16(full, _mm256_shufflehi_epi16(
+                                         _mm256_shufflelo_epi16(sLo, 0xff), 0xff));
+        __m256i invHi = _mm256_sub_epi16(full, _mm256_shufflehi_epi16(
+                                         _mm256_shufflelo_epi16(sHi, 0xff), 0xff));
+        __m256i dLo = mul256(_mm256_unpacklo_epi8(d, zero), invLo);
+        __m256i dHi = mul256(_mm256_unpackhi_epi8(d, zero), invHi);
+        __m256i result = _mm256_packus_epi16(_mm256_add_epi16(sLo, dLo),
+                                             _mm256_add_epi16(sHi, dHi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), result);
+    }
+    blendScalar(dst + i, src + i, count - i, alpha);
+}
+
+KERNELS_TARGET("avx2")
+static void fillAvx2(quint32 *dst, quint32 color, int count)
+{
+    const __m256i c = _mm256_set1_epi32(color);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), c);
+    fillScalar(dst + i, color, count - i);
+}
+
+KERNELS_TARGET("avx2")
+static int matchAvx2(const quint32 *src, int count, quint32 color, int tolerance, bool matching)
+{
+    const __m256i c = _mm256_set1_epi32(color);
+    const __m256i t = _mm256_set1_epi8(char(tolerance));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(s, c), _mm256_subs_epu8(c, s));
+        __m256i over = _mm256_subs_epu8(diff, t);
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(
+                                      _mm256_cmpeq_epi32(over, _mm256_setzero_si256())));
+        if (matching)
+            bits = ~bits & 0xff;
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i + matchScalar(src + i, count - i, color, tolerance, matching);
+}
+#endif
+
+// Constant-initialized, so even a kernel called during static
+// initialization finds a working version.
+static Kernels::Level currentLevel = Kernels::Scalar;
+static BlendFunc blendFunc = blendScalar;
+static FillFunc fillFunc = fillScalar;
+static MatchFunc matchFunc = matchScalar;
+
+static void select(Kernels::Level level)
+{
+    currentLevel = level;
+    blendFunc = blendScalar;
+    fillFunc = fillScalar;
+    matchFunc = matchScalar;
+#ifdef KERNELS_X86
+    if (level == Kernels::SSE2) {
+        blendFunc = blendSse2;
+        fillFunc = fillSse2;
+        matchFunc = matchSse2;
+    } else if (level == Kernels::AVX2) {
+        blendFunc = blendAvx2;
+        fillFunc = fillAvx2;
+        matchFunc = matchAvx2;
+    }
+#endif
+}
+
+namespace {
+
+// Picks the best level while the program starts, before main() and so
+// before any thread can call a kernel; the pointers never change later
+// unless setLevel() is called.
+struct LevelPicker
+{
+    LevelPicker() { select(Kernels::bestLevel()); }
+};
+
+LevelPicker levelPicker;
+
+}
+
+Kernels::Level Kernels::bestLevel()
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SSE2;
+#endif
+    return Scalar;
+}
+
+Kernels::Level Kernels::level()
+{
+    return currentLevel;
+}
+
+bool Kernels::setLevel(Level level)
+{
+    if (level > bestLevel())
+        return false;
+    select(level);
+    return true;
+}
+
+const char *Kernels::levelName(Level level)
+{
+    switch (level)
+    {
+        case AVX2:
+            return "avx2";
+        case SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+void Kernels::blend(quint32 *dst, const quint32 *src, int count, int alpha)
+{
+    blendFunc(dst, src, count, alpha);
+}
+
+void Kernels::fill(quint32 *dst, quint32 color, int count)
+{
+    fillFunc(dst, color, count);
+}
+
+int Kernels::match(const quint32 *src, int count, quint32 color, int tolerance, bool matching)
+{
+    return matchFunc(src, count, color, tolerance, matching);
+}
+
+void Kernels::copy(quint32 *dst, const quint32 *src, int count)
+{
+    // memcpy already picks the widest moves the CPU has.
+    memcpy(dst, src, count * sizeof(quint32));
+}
@@ -0,0 +1,32 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <QtGlobal>
+
+/*
+ * Pixel loops for the canvas format, ARGB32_Premultiplied. Each kernel
+ * has a scalar version and, on x86, SSE2 and AVX2 versions picked once
+ * at startup. All versions round the same way, so the pixels do not
+ * depend on the CPU. setLevel() is for benchmarks and must not be called
+ * while other threads paint. blend() is source-over with an extra
+ * constant alpha. match() counts the leading pixels whose channels all
+ * are, or with matching false are not, within tolerance of color.
+ */
+class Kernels
+{
+public:
+    enum Level { Scalar, SSE2, AVX2 };
+
+    static Level bestLevel();
+    static Level level();
+    static bool setLevel(Level level);
+    static const char *levelName(Level level);
+
+    static void blend(quint32 *dst, const quint32 *src, int count, int alpha = 255);
+    static void fill(quint32 *dst, quint32 color, int count);
+    static void copy(quint32 *dst, const quint32 *src, int count);
+    static int match(const quint32 *src, int count, quint32 color, int tolerance,
+                     bool matching = true);
+};
+
+#endif
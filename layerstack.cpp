@@ -0,0 +1,220 @@
+#include "kernels.h"
+#include "layerstack.h"
+#include "profiler.h"
+
+LayerStack::LayerStack()
+{
+    generation = 0;
+    myCurrent = 0;
+    layers.append(Layer());
+    layers[0].name = QObject::tr("Background");
+    layers[0].paper = true;
+}
+
+void LayerStack::reset(TiledCanvas *active)
+{
+    layers.clear();
+    layers.append(Layer());
+    layers[0].name = QObject::tr("Background");
+    layers[0].paper = true;
+    myCurrent = 0;
+    active->setTransparent(false);
+    invalidate();
+}
+
+void LayerStack::restore(const QList<Layer> &stack, int current, TiledCanvas *active)
+{
+    if (stack.isEmpty())
+        return;
+
+    layers = stack;
+    myCurrent = qBound(0, current, layers.size() - 1);
+    *active = layers[myCurrent].canvas;
+    layers[myCurrent].canvas = TiledCanvas();
+    updatePaper(active);
+    invalidate();
+}
+
+QList<Layer> LayerStack::snapshot(const TiledCanvas &active) const
+{
+    // The copies share their tiles with the stack, so this is cheap.
+    QList<Layer> result = layers;
+    for (int i = 0; i < result.size(); ++i) {
+        if (i == myCurrent)
+            result[i].canvas = active;
+        result[i].canvas.resize(active.size());
+    }
+    return result;
+}
+
+void LayerStack::setCurrent(int i, TiledCanvas *active)
+{
+    if (i < 0 || i >= layers.size() || i == myCurrent)
+        return;
+
+    layers[myCurrent].canvas = *active;
+    *active = layers[i].canvas;
+    active->resize(layers[myCurrent].canvas.size());
+    layers[i].canvas = TiledCanvas();
+    myCurrent = i;
+}
+
+void LayerStack::add(const QString &name, TiledCanvas *active)
+{
+    Layer layer;
+    layer.name = name;
+    layer.canvas.setTransparent(true);
+    layer.canvas.resize(active->size());
+    layers.insert(myCurrent + 1, layer);
+    invalidate();
+
+    setCurrent(myCurrent + 1, active);
+}
+
+void LayerStack::remove(TiledCanvas *active)
+{
+    if (layers.size() < 2)
+        return;
+
+    QSize size = active->size();
+    layers.removeAt(myCurrent);
+    myCurrent = qMin(myCurrent, layers.size() - 1);
+    *active = layers[myCurrent].canvas;
+    active->resize(size);
+    layers[myCurrent].canvas = TiledCanvas();
+    updatePaper(active);
+    invalidate();
+}
+
+void LayerStack::move(int from, int to, TiledCanvas *active)
+{
+    if (from < 0 || from >= layers.size() || to < 0 || to >= layers.size() || from == to)
+        return;
+
+    layers.move(from, to);
+    if (myCurrent == from)
+        myCurrent = to;
+    else if (from < myCurrent && to >= myCurrent)
+        myCurrent--;
+    else if (from > myCurrent && to <= myCurrent)
+        myCurrent++;
+    updatePaper(active);
+    invalidate();
+}
+
+void LayerStack::updatePaper(TiledCanvas *active)
+{
+    // Only the bottom layer is paper; unpainted areas above it let it through.
+    for (int i = 0; i < layers.size(); ++i) {
+        TiledCanvas &canvas = (i == myCurrent) ? *active : layers[i].canvas;
+        canvas.setTransparent(i > 0);
+        if (i > 0)
+            layers[i].paper = false;
+    }
+}
+
+void LayerStack::setOpacity(int i, qreal opacity)
+{
+    layers[i].opacity = qBound(qreal(0), opacity, qreal(1));
+    invalidate();
+}
+
+void LayerStack::setVisible(int i, bool visible)
+{
+    layers[i].visible = visible;
+    invalidate();
+}
+
+void LayerStack::setBlendMode(int i, QPainter::CompositionMode mode)
+{
+    layers[i].mode = mode;
+    invalidate();
+}
+
+void LayerStack::setTile(int i, int tx, int ty, const QImage &tile, TiledCanvas *active)
+{
+    // Composite tiles notice the new cache key on their own.
+    TiledCanvas &canvas = (i == myCurrent) ? *active : layers[i].canvas;
+    canvas.setTile(tx, ty, tile);
+}
+
+void LayerStack::invalidate()
+{
+    // Stack changes touch every tile; a new generation makes all of them stale.
+    generation++;
+}
+
+void LayerStack::draw(QPainter *painter, const QRect &rect, const TiledCanvas &active)
+{
+    compose(rect, active);
+    composite.draw(painter, rect);
+}
+
+const TiledCanvas &LayerStack::flatten(const TiledCanvas &active, const QRect &rect)
+{
+    compose(rect.isNull() ? active.rect() : rect, active);
+    return composite;
+}
+
+void LayerStack::compose(const QRect &rect, const TiledCanvas &active)
+{
+    composite.resize(active.size());
+    QRect area = rect.intersected(composite.rect());
+    if (area.isEmpty())
+        return;
+
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty)
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx)
+            composeTile(tx, ty, active);
+}
+
+void LayerStack::composeTile(int tx, int ty, const TiledCanvas &active)
+{
+    QList<QImage> tiles;
+    QList<qint64> keys;
+    keys << generation;
+    for (int i = 0; i < layers.size(); ++i) {
+        QImage tile = (i == myCurrent) ? active.tile(tx, ty) : layers[i].canvas.tile(tx, ty);
+        tiles << tile;
+        keys << tile.cacheKey();
+    }
+
+    quint32 key = TiledCanvas::tileKey(tx, ty);
+    QHash<quint32, QList<qint64> >::iterator it = sources.find(key);
+    if (it != sources.end() && it.value() == keys)
+        return;
+    sources.insert(key, keys);
+
+    const Layer &bottom = layers.first();
+    bool plain = bottom.paper && bottom.visible && bottom.opacity == 1.0;
+    for (int i = 1; i < layers.size() && plain; ++i)
+        plain = !layers[i].visible || tiles[i].isNull();
+    if (plain) {
+        composite.setTile(tx, ty, tiles.first());
+        return;
+    }
+
+    PROFILE_COUNT("composite tiles", 1);
+    QImage result(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+    result.fill(qRgb(255, 255, 255));
+    quint32 *pixels = reinterpret_cast<quint32 *>(result.bits());
+    for (int i = 0; i < layers.size(); ++i) {
+        if (!layers[i].visible || tiles[i].isNull())
+            continue;
+
+        // Tiles have no padding, so a whole tile is one span.
+        if (layers[i].mode == QPainter::CompositionMode_SourceOver) {
+            Kernels::blend(pixels, reinterpret_cast<const quint32 *>(tiles[i].constBits()),
+                           TILE_SIZE * TILE_SIZE, qRound(layers[i].opacity * 255));
+            continue;
+        }
+
+        QPainter painter(&result);
+        painter.setOpacity(layers[i].opacity);
+        painter.setCompositionMode(layers[i].mode);
+        painter.drawImage(0, 0, tiles[i]);
+        painter.end();
+        pixels = reinterpret_cast<quint32 *>(result.bits());
+    }
+    composite.setTile(tx, ty, result);
+}
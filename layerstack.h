@@ -0,0 +1,76 @@
+#ifndef LAYERSTACK_H
+#define LAYERSTACK_H
+
+#include <QHash>
+#include <QObject>
+#include <QList>
+#include <QPainter>
+#include <QRect>
+#include <QString>
+
+#include "tiledcanvas.h"
+
+struct Layer
+{
+    Layer() : opacity(1.0), visible(true), mode(QPainter::CompositionMode_SourceOver),
+              paper(false) {}
+
+    QString name;
+    TiledCanvas canvas;
+    qreal opacity;
+    bool visible;
+    QPainter::CompositionMode mode;
+    bool paper;     // always the bottom layer, so every tile is opaque
+};
+
+/*
+ * The layers of a picture, bottom first, and their flattened composite.
+ * The current layer is checked out: its pixels live in the canvas the
+ * caller edits, which is passed in wherever the stack needs them and
+ * swapped back in when another layer becomes current.
+ *
+ * Each composite tile remembers the cache keys of the layer tiles it was
+ * blended from, so only tiles whose sources changed are blended again.
+ * With a single plain paper layer the composite shares that layer's
+ * tiles; a layer that was ever stacked over others may hold transparent
+ * pixels, so once it is at the bottom it is composed onto white.
+ */
+class LayerStack
+{
+public:
+    LayerStack();
+
+    void reset(TiledCanvas *active);
+    void restore(const QList<Layer> &stack, int current, TiledCanvas *active);
+    int count() const { return layers.size(); }
+    int current() const { return myCurrent; }
+    const Layer &layer(int i) const { return layers.at(i); }
+    QList<Layer> snapshot(const TiledCanvas &active) const;
+
+    void setCurrent(int i, TiledCanvas *active);
+    void add(const QString &name, TiledCanvas *active);
+    void remove(TiledCanvas *active);
+    void move(int from, int to, TiledCanvas *active);
+    void setOpacity(int i, qreal opacity);
+    void setVisible(int i, bool visible);
+    void setBlendMode(int i, QPainter::CompositionMode mode);
+    void setTile(int i, int tx, int ty, const QImage &tile, TiledCanvas *active);
+
+    void draw(QPainter *painter, const QRect &rect, const TiledCanvas &active);
+    const TiledCanvas &flatten(const TiledCanvas &active, const QRect &rect = QRect());
+
+private:
+    void compose(const QRect &rect, const TiledCanvas &active);
+    void composeTile(int tx, int ty, const TiledCanvas &active);
+    void updatePaper(TiledCanvas *active);
+    void invalidate();
+
+    QList<Layer> layers;
+    int myCurrent;
+
+    TiledCanvas composite;
+    QHash<quint32, QList<qint64> > sources;
+    qint64 generation;
+};
+
+#endif
@@ -1,11 +1,21 @@
 #include <QApplication>
+#include <cstring>
 #include "mainwindow.h"
+#include "startupprofile.h"
 
 int main(int argc, char *argv[])
 {
+    StartupProfile::start();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--profile-startup") == 0)
+            StartupProfile::setEnabled(true);
+    }
+
     QApplication a(argc, argv);
+    StartupProfile::mark("QApplication");
     MainWindow w;
     w.show();
+    StartupProfile::mark("show");
 
     return a.exec();
 }
@@ -1,20 +1,32 @@
 #include <QtGui>
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "journal.h"
 #include "scribblearea.h"
+#include "profiler.h"
+#include "startupprofile.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+    StartupProfile::mark("setupUi");
 
     scribbleArea = new ScribbleArea;
     setCentralWidget(scribbleArea);
+    StartupProfile::mark("ScribbleArea");
 
-    createSaveAsMenu();
+    // Listing the image writer plugins is slow; wait until it is wanted.
+    connect(ui->saveAsMenu, SIGNAL(aboutToShow()), this, SLOT(createSaveAsMenu()));
     createActionGroup();
     createToolsInDock();
+    createStatusBar();
+    createLayersDock();
+#ifdef SCRIBBLE_PROFILING
+    createProfilingTools();
+#endif
+    StartupProfile::mark("docks and actions");
 
     connectActs();
     setActShortcuts();
@@ -23,6 +35,12 @@ MainWindow::MainWindow(QWidget *parent) :
 
     setWindowTitle(tr("My Scribble"));
     resize(800, 600);
+
+    // The journal and the recovery question wait for the first frame; the
+    // queued call keeps the dialog out of the paint event.
+    connect(scribbleArea, SIGNAL(firstFramePainted()), this, SLOT(startAutosave()),
+            Qt::QueuedConnection);
+    StartupProfile::mark("MainWindow");
 }
 
 MainWindow::~MainWindow()
@@ -32,20 +50,47 @@ MainWindow::~MainWindow()
 
 void MainWindow::closeEvent(QCloseEvent *event)
 {
-    if (maybeSave()) {
+    if (maybeSave() && waitForSaves()) {
+        scribbleArea->stopJournal();
         event->accept();
     } else {
         event->ignore();
     }
 }
 
+void MainWindow::startAutosave()
+{
+    QString dir = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+    QDir().mkpath(dir);
+
+    // Journals of other running instances are theirs; only a dead one's is offered.
+    QString orphan = Journal::orphan(dir);
+    if (!orphan.isEmpty()) {
+        QMessageBox::StandardButton ret;
+        ret = QMessageBox::question(this, tr("Scribble"),
+                                    tr("Scribble did not exit cleanly.\n"
+                                       "Do you want to recover the unsaved drawing?"),
+                                    QMessageBox::Yes | QMessageBox::No);
+        if (ret == QMessageBox::Yes && !scribbleArea->recoverJournal(orphan)) {
+            QMessageBox::warning(this, tr("Scribble"),
+                                 tr("Cannot recover the drawing from %1.").arg(orphan));
+        } else {
+            // The recovered drawing goes into this instance's own journal.
+            Journal::remove(orphan);
+        }
+    }
+
+    scribbleArea->startJournal(Journal::fileNameFor(dir));
+}
+
 void MainWindow::open()
 {
     if (maybeSave()) {
         QString fileName = QFileDialog::getOpenFileName(this,
                                    tr("Open File"), QDir::currentPath());
-        if (!fileName.isEmpty()) {
-            scribbleArea->openImage(fileName);
+        if (!fileName.isEmpty() && !scribbleArea->openImage(fileName)) {
+            QMessageBox::warning(this, tr("Scribble"),
+                                 tr("Cannot read file %1.").arg(fileName));
         }
     }
 }
@@ -59,12 +104,16 @@ void MainWindow::save()
 
 void MainWindow::undo()
 {
-    scribbleArea->moveHistory(-1);
+    if (!scribbleArea->moveHistory(-1))
+        QMessageBox::warning(this, tr("Scribble"),
+                             tr("Cannot read the undo history back from disk."));
 }
 
 void MainWindow::redo()
 {
-    scribbleArea->moveHistory(1);
+    if (!scribbleArea->moveHistory(1))
+        QMessageBox::warning(this, tr("Scribble"),
+                             tr("Cannot read the redo history back from disk."));
 }
 
 void MainWindow::penColor()
@@ -87,6 +136,42 @@ void MainWindow::penWidth()
     updateActs();
 }
 
+void MainWindow::historyBudget()
+{
+    bool ok;
+    int megabytes = QInputDialog::getInt(this, tr("History Budget"),
+                                         tr("Uncompressed undo history (MB):"),
+                                         scribbleArea->historyBudget() / (1024 * 1024),
+                                         16, 16384, 16, &ok);
+    if (ok)
+        scribbleArea->setHistoryBudget(qint64(megabytes) * 1024 * 1024);
+}
+
+void MainWindow::fillTolerance()
+{
+    bool ok;
+    int tolerance = QInputDialog::getInt(this, tr("Fill Tolerance"),
+                                         tr("Largest channel difference to fill over (0-255):"),
+                                         scribbleArea->fillTolerance(), 0, 255, 1, &ok);
+    if (ok)
+        scribbleArea->setFillTolerance(tolerance);
+}
+
+void MainWindow::zoomIn()
+{
+    scribbleArea->setZoom(scribbleArea->zoomFactor() * 1.25);
+}
+
+void MainWindow::zoomOut()
+{
+    scribbleArea->setZoom(scribbleArea->zoomFactor() * 0.8);
+}
+
+void MainWindow::actualSize()
+{
+    scribbleArea->setZoom(1.0);
+}
+
 void MainWindow::shape(QAction *action)
 {
     if (action) {
@@ -120,7 +205,14 @@ void MainWindow::about()
 
 void MainWindow::createSaveAsMenu()
 {
-    foreach (QByteArray format, QImageWriter::supportedImageFormats()) {
+    if (!saveAsActs.isEmpty())
+        return;
+
+    QList<QByteArray> formats = QImageWriter::supportedImageFormats();
+    formats.prepend("scrv");
+    formats.prepend("scribble");
+
+    foreach (QByteArray format, formats) {
         QString text = tr("%1...").arg(QString(format).toUpper());
 
         QAction *action = new QAction(text, this);
@@ -145,6 +237,7 @@ void MainWindow::createActionGroup()
     drawActionGroup->addAction(ui->drawCurveAct);
     drawActionGroup->addAction(ui->drawTextAct);
     drawActionGroup->addAction(ui->eraseAct);
+    drawActionGroup->addAction(ui->drawFillAct);
     drawActionGroup->addAction(ui->selectAct);
 
     ui->drawPencilAct->setData(QVariant(PENCIL));
@@ -157,6 +250,7 @@ void MainWindow::createActionGroup()
     ui->drawCurveAct->setData(QVariant(CURVE));
     ui->drawPieAct->setData(QVariant(PIE));
     ui->eraseAct->setData(QVariant(ERASER));
+    ui->drawFillAct->setData(QVariant(FILL));
     ui->selectAct->setData(QVariant(SELECT));
 
     ui->drawLineAct->setChecked(true);
@@ -185,6 +279,157 @@ void MainWindow::createToolsInDock()
                 ui->brushStyleComboBox->findData(QVariant(scribbleArea->brushStyle())));
 }
 
+void MainWindow::createStatusBar()
+{
+    repaintLabel = new QLabel;
+    statusBar()->addPermanentWidget(repaintLabel);
+
+    zoomLabel = new QLabel(tr("100%"));
+    statusBar()->addPermanentWidget(zoomLabel);
+
+    saveProgressBar = new QProgressBar;
+    saveProgressBar->setRange(0, 100);
+    saveProgressBar->setMaximumWidth(150);
+    saveProgressBar->hide();
+    statusBar()->addPermanentWidget(saveProgressBar);
+}
+
+void MainWindow::createLayersDock()
+{
+    layerList = new QListWidget;
+    connect(layerList, SIGNAL(currentRowChanged(int)), this, SLOT(layerSelected(int)));
+
+    layerVisibleBox = new QCheckBox(tr("Visible"));
+    connect(layerVisibleBox, SIGNAL(toggled(bool)), scribbleArea, SLOT(setLayerVisible(bool)));
+
+    layerOpacitySlider = new QSlider(Qt::Horizontal);
+    layerOpacitySlider->setRange(0, 100);
+    connect(layerOpacitySlider, SIGNAL(valueChanged(int)), scribbleArea, SLOT(setLayerOpacity(int)));
+
+    layerModeComboBox = new QComboBox;
+    layerModeComboBox->addItem("Normal"  , QPainter::CompositionMode_SourceOver);
+    layerModeComboBox->addItem("Multiply", QPainter::CompositionMode_Multiply);
+    layerModeComboBox->addItem("Screen"  , QPainter::CompositionMode_Screen);
+    layerModeComboBox->addItem("Overlay" , QPainter::CompositionMode_Overlay);
+    layerModeComboBox->addItem("Darken"  , QPainter::CompositionMode_Darken);
+    layerModeComboBox->addItem("Lighten" , QPainter::CompositionMode_Lighten);
+    layerModeComboBox->addItem("Difference", QPainter::CompositionMode_Difference);
+    connect(layerModeComboBox, SIGNAL(activated(int)), this, SLOT(layerModeChanged(int)));
+
+    QPushButton *addButton = new QPushButton(tr("Add"));
+    QPushButton *removeButton = new QPushButton(tr("Remove"));
+    QPushButton *raiseButton = new QPushButton(tr("Up"));
+    QPushButton *lowerButton = new QPushButton(tr("Down"));
+    connect(addButton, SIGNAL(clicked()), scribbleArea, SLOT(addLayer()));
+    connect(removeButton, SIGNAL(clicked()), scribbleArea, SLOT(removeLayer()));
+    connect(raiseButton, SIGNAL(clicked()), scribbleArea, SLOT(raiseLayer()));
+    connect(lowerButton, SIGNAL(clicked()), scribbleArea, SLOT(lowerLayer()));
+
+    QHBoxLayout *buttons = new QHBoxLayout;
+    buttons->addWidget(addButton);
+    buttons->addWidget(removeButton);
+    buttons->addWidget(raiseButton);
+    buttons->addWidget(lowerButton);
+
+    QFormLayout *properties = new QFormLayout;
+    properties->addRow(tr("Opacity"), layerOpacitySlider);
+    properties->addRow(tr("Blend"), layerModeComboBox);
+    properties->addRow(layerVisibleBox);
+
+    QWidget *content = new QWidget;
+    QVBoxLayout *layout = new QVBoxLayout(content);
+    layout->addWidget(layerList);
+    layout->addLayout(buttons);
+    layout->addLayout(properties);
+
+    QDockWidget *layersDock = new QDockWidget(tr("Layers"), this);
+    layersDock->setWidget(content);
+    addDockWidget(Qt::RightDockWidgetArea, layersDock);
+
+    connect(scribbleArea, SIGNAL(layersChanged()), this, SLOT(updateLayers()));
+    updateLayers();
+}
+
+void MainWindow::updateLayers()
+{
+    // The list shows the top layer first.
+    const LayerStack &layers = scribbleArea->layerStack();
+    const Layer &current = layers.layer(layers.current());
+    QList<QWidget *> widgets;
+    widgets << layerList << layerOpacitySlider << layerVisibleBox << layerModeComboBox;
+    foreach (QWidget *widget, widgets)
+        widget->blockSignals(true);
+
+    layerList->clear();
+    for (int i = layers.count() - 1; i >= 0; --i)
+        layerList->addItem(layers.layer(i).name);
+    layerList->setCurrentRow(layers.count() - 1 - layers.current());
+    layerOpacitySlider->setValue(qRound(current.opacity * 100));
+    layerVisibleBox->setChecked(current.visible);
+    layerModeComboBox->setCurrentIndex(layerModeComboBox->findData(int(current.mode)));
+
+    foreach (QWidget *widget, widgets)
+        widget->blockSignals(false);
+}
+
+void MainWindow::layerModeChanged(int index)
+{
+    scribbleArea->setLayerBlendMode(layerModeComboBox->itemData(index).toInt());
+}
+
+void MainWindow::layerSelected(int row)
+{
+    if (row >= 0)
+        scribbleArea->setCurrentLayer(scribbleArea->layerStack().count() - 1 - row);
+}
+
+#ifdef SCRIBBLE_PROFILING
+void MainWindow::createProfilingTools()
+{
+    QFont font("Monospace");
+    font.setStyleHint(QFont::TypeWriter);
+    hudLabel = new QLabel;
+    hudLabel->setFont(font);
+    hudLabel->setAlignment(Qt::AlignLeft | Qt::AlignTop);
+
+    hudDock = new QDockWidget(tr("Performance"), this);
+    hudDock->setWidget(hudLabel);
+    addDockWidget(Qt::RightDockWidgetArea, hudDock);
+    hudDock->hide();
+
+    QMenu *debugMenu = new QMenu(tr("&Debug"), this);
+    debugMenu->addAction(hudDock->toggleViewAction());
+    QAction *exportTraceAct = debugMenu->addAction(tr("&Export Trace..."));
+    connect(exportTraceAct, SIGNAL(triggered()), this, SLOT(exportTrace()));
+    menuBar()->insertMenu(ui->helpMenu->menuAction(), debugMenu);
+
+    QTimer *hudTimer = new QTimer(this);
+    connect(hudTimer, SIGNAL(timeout()), this, SLOT(updateHud()));
+    hudTimer->start(500);
+}
+
+void MainWindow::updateHud()
+{
+    if (!hudDock->isVisible())
+        return;
+
+    hudLabel->setText(Profiler::instance()->summary() + "\n"
+                      + QString("%1 %2").arg("history bytes", -16)
+                                        .arg(scribbleArea->historyBytes(), 6));
+}
+
+void MainWindow::exportTrace()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Export Trace"),
+                               QDir::currentPath() + "/scribble-trace.json",
+                               tr("Chrome Trace (*.json);;All Files (*)"));
+    if (!fileName.isEmpty() && !Profiler::instance()->exportTrace(fileName)) {
+        QMessageBox::warning(this, tr("Scribble"),
+                             tr("Cannot write file %1.").arg(fileName));
+    }
+}
+#endif // SCRIBBLE_PROFILING
+
 void MainWindow::connectActs()
 {
     connect(ui->openAct, SIGNAL(triggered()), this, SLOT(open()));
@@ -196,6 +441,17 @@ void MainWindow::connectActs()
 
     connect(ui->printAct, SIGNAL(triggered()), scribbleArea, SLOT(print()));
     connect(ui->clearScreenAct, SIGNAL(triggered()), scribbleArea, SLOT(clearImage()));
+    connect(ui->smoothStrokesAct, SIGNAL(toggled(bool)), scribbleArea, SLOT(setSmoothStrokes(bool)));
+    connect(ui->adaptivePreviewAct, SIGNAL(toggled(bool)),
+            scribbleArea, SLOT(setAdaptivePreview(bool)));
+    connect(ui->historyBudgetAct, SIGNAL(triggered()), this, SLOT(historyBudget()));
+    connect(ui->fillToleranceAct, SIGNAL(triggered()), this, SLOT(fillTolerance()));
+    connect(ui->zoomInAct, SIGNAL(triggered()), this, SLOT(zoomIn()));
+    connect(ui->zoomOutAct, SIGNAL(triggered()), this, SLOT(zoomOut()));
+    connect(ui->actualSizeAct, SIGNAL(triggered()), this, SLOT(actualSize()));
+    connect(ui->vectorModeAct, SIGNAL(toggled(bool)), scribbleArea, SLOT(setVectorMode(bool)));
+    connect(scribbleArea, SIGNAL(vectorModeChanged(bool)),
+            ui->vectorModeAct, SLOT(setChecked(bool)));
 
     connect(ui->aboutAct, SIGNAL(triggered()), this, SLOT(about()));
     connect(ui->aboutQtAct, SIGNAL(triggered()), qApp, SLOT(aboutQt()));
@@ -209,6 +465,15 @@ void MainWindow::connectActs()
     connect(ui->brushStyleComboBox, SIGNAL(activated(int)), this, SLOT(brush()));
 
     connect(ui->penWidthSlider, SIGNAL(valueChanged(int)), this, SLOT(penWidth()));
+
+    connect(scribbleArea, SIGNAL(repaintRateChanged(qint64)),
+            this, SLOT(repaintRate(qint64)));
+    connect(scribbleArea, SIGNAL(zoomChanged(qreal)), this, SLOT(zoomChanged(qreal)));
+    connect(scribbleArea, SIGNAL(saveProgress(int)), this, SLOT(saveProgress(int)));
+    connect(scribbleArea, SIGNAL(saveFinished(QString,bool)),
+            this, SLOT(saveFinished(QString,bool)));
+    connect(scribbleArea, SIGNAL(loadFinished(QString,bool)),
+            this, SLOT(loadFinished(QString,bool)));
 }
 
 void MainWindow::setActShortcuts()
@@ -218,6 +483,9 @@ void MainWindow::setActShortcuts()
     ui->undoAct->setShortcuts(QKeySequence::Undo);
     ui->redoAct->setShortcuts(QKeySequence::Redo);
     ui->clearScreenAct->setShortcut(tr("Ctrl+L"));
+    ui->zoomInAct->setShortcuts(QKeySequence::ZoomIn);
+    ui->zoomOutAct->setShortcuts(QKeySequence::ZoomOut);
+    ui->actualSizeAct->setShortcut(tr("Ctrl+0"));
 
     ui->cutAct->setShortcut(QKeySequence::Cut);
     ui->copyAct->setShortcut(QKeySequence::Copy);
@@ -248,6 +516,18 @@ bool MainWindow::maybeSave()
     return true;
 }
 
+bool MainWindow::waitForSaves()
+{
+    if (!scribbleArea->isSaving())
+        return true;
+
+    statusBar()->showMessage(tr("Waiting for pending saves..."));
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    bool ok = scribbleArea->waitForSaves();
+    QApplication::restoreOverrideCursor();
+    return ok;
+}
+
 bool MainWindow::saveFile(const QByteArray &fileFormat)
 {
     QString initialPath = QDir::currentPath() + "/untitled." + fileFormat;
@@ -282,5 +562,42 @@ void MainWindow::copy()
 
 void MainWindow::paste()
 {
-    if (scribbleArea->shape() == SELECT) scribbleArea->togglePasting();
+    scribbleArea->pasteClipboard();
+}
+
+void MainWindow::repaintRate(qint64 pixelsPerSecond)
+{
+    repaintLabel->setText(tr("Repainted: %1 px/s").arg(pixelsPerSecond));
+}
+
+void MainWindow::zoomChanged(qreal factor)
+{
+    zoomLabel->setText(tr("%1%").arg(qRound(factor * 100)));
+}
+
+void MainWindow::saveProgress(int percent)
+{
+    saveProgressBar->setValue(percent);
+    saveProgressBar->show();
+}
+
+void MainWindow::saveFinished(const QString &fileName, bool ok)
+{
+    if (!scribbleArea->isSaving())
+        saveProgressBar->hide();
+
+    if (ok) {
+        statusBar()->showMessage(tr("Saved %1").arg(fileName), 2000);
+    } else {
+        QMessageBox::warning(this, tr("Scribble"),
+                             tr("Cannot write file %1.").arg(fileName));
+    }
+}
+
+void MainWindow::loadFinished(const QString &fileName, bool ok)
+{
+    if (!ok) {
+        QMessageBox::warning(this, tr("Scribble"),
+                             tr("Cannot read file %1.").arg(fileName));
+    }
 }
@@ -7,6 +7,14 @@
 #include "common.h"
 #include "scribblearea.h"
 
+class QCheckBox;
+class QComboBox;
+class QDockWidget;
+class QLabel;
+class QListWidget;
+class QProgressBar;
+class QSlider;
+
 namespace Ui {
 class MainWindow;
 }
@@ -30,6 +38,11 @@ private slots:
     void penColor();
     void brushColor();
     void penWidth();
+    void historyBudget();
+    void fillTolerance();
+    void zoomIn();
+    void zoomOut();
+    void actualSize();
     void about();
     void shape(QAction *);
     void pen();
@@ -39,10 +52,30 @@ private slots:
     void copy();
     void paste();
 
-private:
+    void repaintRate(qint64 pixelsPerSecond);
+    void zoomChanged(qreal factor);
+    void saveProgress(int percent);
+    void saveFinished(const QString &fileName, bool ok);
+    void loadFinished(const QString &fileName, bool ok);
+    void updateLayers();
+    void layerSelected(int row);
+    void layerModeChanged(int index);
     void createSaveAsMenu();
+    void startAutosave();
+
+#ifdef SCRIBBLE_PROFILING
+    void updateHud();
+    void exportTrace();
+#endif
+
+private:
     void createActionGroup();
     void createToolsInDock();
+    void createStatusBar();
+    void createLayersDock();
+#ifdef SCRIBBLE_PROFILING
+    void createProfilingTools();
+#endif
 
     void connectActs();
     void setActShortcuts();
@@ -50,6 +83,7 @@ private:
     void updateActs();
 
     bool maybeSave();
+    bool waitForSaves();
     bool saveFile(const QByteArray &fileFormat);
 
     Ui::MainWindow *ui;
@@ -57,6 +91,17 @@ private:
 
     QList<QAction *> saveAsActs;
     QActionGroup *drawActionGroup;
+    QLabel *repaintLabel;
+    QLabel *zoomLabel;
+    QProgressBar *saveProgressBar;
+    QListWidget *layerList;
+    QSlider *layerOpacitySlider;
+    QCheckBox *layerVisibleBox;
+    QComboBox *layerModeComboBox;
+#ifdef SCRIBBLE_PROFILING
+    QDockWidget *hudDock;
+    QLabel *hudLabel;
+#endif
 };
 
 #endif
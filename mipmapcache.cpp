@@ -0,0 +1,105 @@
+#include <QPainter>
+#include <QPair>
+#include <QVector>
+#include "mipmapcache.h"
+#include "profiler.h"
+#include "tiledcanvas.h"
+
+// Level 5 is a 4x4 image of a tile; smaller is not worth the bookkeeping.
+static const int MaxLevel = 5;
+static const int MaxEntries = 8192;
+
+MipmapCache::MipmapCache()
+{
+    frame = 0;
+}
+
+void MipmapCache::draw(QPainter *painter, const TiledCanvas &canvas, const QRect &rect,
+                       qreal zoom, const QPoint &origin, bool smooth)
+{
+    QRect area = rect.intersected(canvas.rect());
+    if (area.isEmpty())
+        return;
+
+    int levelIndex = 0;
+    while (levelIndex < MaxLevel && zoom * (2 << levelIndex) <= 1.0)
+        levelIndex++;
+
+    painter->save();
+    painter->translate(origin);
+    painter->scale(zoom, zoom);
+    painter->setRenderHint(QPainter::SmoothPixmapTransform, smooth && zoom < 1.0);
+
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+            QImage tile = canvas.tile(tx, ty);
+            if (tile.isNull())
+                continue;
+
+            QRect target = TiledCanvas::tileRect(tx, ty).intersected(canvas.rect());
+            QImage image = level(tile, tx, ty, levelIndex);
+            QRectF source(QPointF(0, 0), QSizeF(target.size()) / (1 << levelIndex));
+            painter->drawImage(QRectF(target), image, source);
+        }
+    }
+
+    painter->restore();
+}
+
+void MipmapCache::trim()
+{
+    quint64 current = frame++;
+    if (entries.size() <= MaxEntries)
+        return;
+
+    // Trimming to three quarters keeps the sort off most frames.
+    QVector<QPair<quint64, quint32> > stale;
+    QHash<quint32, Entry>::const_iterator it;
+    for (it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        if (it.value().frame != current)
+            stale << qMakePair(it.value().frame, it.key());
+    }
+    qSort(stale);
+
+    int excess = qMin(entries.size() - MaxEntries * 3 / 4, stale.size());
+    for (int i = 0; i < excess; ++i)
+        entries.remove(stale[i].second);
+}
+
+QImage MipmapCache::level(const QImage &tile, int tx, int ty, int level)
+{
+    if (level == 0)
+        return tile;
+
+    Entry &entry = entries[TiledCanvas::tileKey(tx, ty)];
+    if (entry.cacheKey != tile.cacheKey() || entry.levels.isEmpty()) {
+        entry.cacheKey = tile.cacheKey();
+        entry.levels.clear();
+    }
+    entry.frame = frame;
+
+    while (entry.levels.size() < level) {
+        PROFILE_COUNT("mipmap levels", 1);
+        entry.levels << halve(entry.levels.isEmpty() ? tile : entry.levels.last());
+    }
+    return entry.levels.at(level - 1);
+}
+
+QImage MipmapCache::halve(const QImage &image)
+{
+    // A 2x2 box filter; premultiplied channels can be averaged directly.
+    QImage result(image.width() / 2, image.height() / 2, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < result.height(); ++y) {
+        const QRgb *top = reinterpret_cast<const QRgb *>(image.constScanLine(2 * y));
+        const QRgb *bottom = reinterpret_cast<const QRgb *>(image.constScanLine(2 * y + 1));
+        QRgb *line = reinterpret_cast<QRgb *>(result.scanLine(y));
+        for (int x = 0; x < result.width(); ++x) {
+            QRgb a = top[2 * x], b = top[2 * x + 1], c = bottom[2 * x], d = bottom[2 * x + 1];
+            line[x] = qRgba((qRed(a) + qRed(b) + qRed(c) + qRed(d) + 2) / 4,
+                            (qGreen(a) + qGreen(b) + qGreen(c) + qGreen(d) + 2) / 4,
+                            (qBlue(a) + qBlue(b) + qBlue(c) + qBlue(d) + 2) / 4,
+                            (qAlpha(a) + qAlpha(b) + qAlpha(c) + qAlpha(d) + 2) / 4);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,49 @@
+#ifndef MIPMAPCACHE_H
+#define MIPMAPCACHE_H
+
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QPoint>
+#include <QRect>
+
+class QPainter;
+class TiledCanvas;
+
+/*
+ * Halved copies of canvas tiles for drawing zoomed-out views. The levels
+ * of a tile are built the first time it is drawn at that zoom and kept
+ * until the tile's cache key changes, so an edit only rebuilds the tiles
+ * it touched. Each tile is drawn from the smallest level that is still
+ * at least as large as it appears on screen.
+ *
+ * Every entry remembers the frame that last drew it. trim() ends a frame
+ * and, once the cache is over its size, drops the least recently drawn
+ * entries; the ones the frame just drew are always kept.
+ */
+class MipmapCache
+{
+public:
+    MipmapCache();
+
+    void draw(QPainter *painter, const TiledCanvas &canvas, const QRect &rect,
+              qreal zoom, const QPoint &origin, bool smooth = true);
+    void trim();
+    void clear() { entries.clear(); }
+
+private:
+    struct Entry
+    {
+        qint64 cacheKey;
+        quint64 frame;
+        QList<QImage> levels;
+    };
+
+    static QImage halve(const QImage &image);
+    QImage level(const QImage &tile, int tx, int ty, int level);
+
+    QHash<quint32, Entry> entries;
+    quint64 frame;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include <QPainter>
+#include <QPrinter>
+#include "printjob.h"
+#include "profiler.h"
+
+#ifndef QT_NO_PRINTER
+// The most a band of canvas pixels may take before it is sent to the printer.
+static const int BandBytes = 8 * 1024 * 1024;
+
+PrintJob::PrintJob(const TiledCanvas &canvas, QPrinter *printer, QObject *parent)
+    : QThread(parent), canvas(canvas), printer(printer), canceled(0), ok(false)
+{
+}
+
+PrintJob::~PrintJob()
+{
+    wait();
+    delete printer;
+}
+
+void PrintJob::run()
+{
+    PROFILE_SCOPE("print");
+    QPainter painter;
+    if (canvas.rect().isEmpty() || !painter.begin(printer))
+        return;
+
+    QRect rect = painter.viewport();
+    QSize size = canvas.size();
+    size.scale(rect.size(), Qt::KeepAspectRatio);
+    painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
+    painter.setWindow(canvas.rect());
+
+    // One extra row overlaps the next band, so scaling leaves no seams.
+    int rows = qBound(1, BandBytes / (canvas.width() * 4) - 1, canvas.height());
+    QImage band(canvas.width(), rows + 1, QImage::Format_RGB32);
+    for (int y = 0; y < canvas.height(); y += rows) {
+        if (canceled) {
+            printer->abort();
+            return;
+        }
+
+        QRect area = QRect(0, y, canvas.width(), rows + 1).intersected(canvas.rect());
+        band.fill(qRgb(255, 255, 255));
+        QPainter bandPainter(&band);
+        bandPainter.translate(0, -y);
+        canvas.draw(&bandPainter, area);
+        bandPainter.end();
+
+        painter.drawImage(area.topLeft(), band, QRect(QPoint(0, 0), area.size()));
+        emit progress(100 * qMin(y + rows, canvas.height()) / canvas.height());
+    }
+    ok = painter.end();
+}
+#endif // QT_NO_PRINTER
@@ -0,0 +1,45 @@
+#ifndef PRINTJOB_H
+#define PRINTJOB_H
+
+#include <QAtomicInt>
+#include <QThread>
+
+#include "tiledcanvas.h"
+
+#ifndef QT_NO_PRINTER
+class QPrinter;
+
+/*
+ * Prints a snapshot of the picture on its own thread, one band of rows
+ * at a time. Only one band is ever copied out of the tiles, and the print
+ * engine only scales and buffers that band, so memory stays bounded
+ * however large the canvas is. The job owns the printer.
+ */
+class PrintJob : public QThread
+{
+    Q_OBJECT
+
+public:
+    PrintJob(const TiledCanvas &canvas, QPrinter *printer, QObject *parent = 0);
+    ~PrintJob();
+
+    bool succeeded() const { return ok; }
+
+public slots:
+    void cancel() { canceled = 1; }
+
+signals:
+    void progress(int percent);
+
+protected:
+    void run();
+
+private:
+    TiledCanvas canvas;
+    QPrinter *printer;
+    QAtomicInt canceled;
+    bool ok;
+};
+#endif // QT_NO_PRINTER
+
+#endif
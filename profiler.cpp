@@ -0,0 +1,140 @@
+#include "profiler.h"
+
+#ifdef SCRIBBLE_PROFILING
+
+#include <QFile>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+
+// Keep roughly the last minute of a busy session.
+static const int MaxTraceEvents = 200000;
+
+Profiler *Profiler::instance()
+{
+    static Profiler profiler;
+    return &profiler;
+}
+
+Profiler::Profiler()
+    : firstInput(-1), lastFrame(-1)
+{
+    clock.start();
+    events.reserve(MaxTraceEvents);
+}
+
+void Profiler::record(const char *name, qint64 start, qint64 duration)
+{
+    QMutexLocker locker(&mutex);
+
+    if (events.size() >= MaxTraceEvents)
+        events.remove(0, MaxTraceEvents / 2);
+
+    TraceEvent event;
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    event.thread = qint64(quintptr(QThread::currentThreadId()));
+    events.append(event);
+
+    addStat(name, duration);
+}
+
+void Profiler::count(const char *name, qint64 n)
+{
+    QMutexLocker locker(&mutex);
+    counters[name] += n;
+}
+
+void Profiler::markInput()
+{
+    QMutexLocker locker(&mutex);
+    if (firstInput < 0)
+        firstInput = now();
+}
+
+void Profiler::markFrame()
+{
+    QMutexLocker locker(&mutex);
+    qint64 t = now();
+
+    if (lastFrame >= 0)
+        addStat("frame interval", t - lastFrame);
+    lastFrame = t;
+
+    // Latency from the oldest input that had not reached the screen yet.
+    if (firstInput >= 0) {
+        addStat("event to pixel", t - firstInput);
+        firstInput = -1;
+    }
+}
+
+void Profiler::addStat(const QByteArray &name, qint64 value)
+{
+    Stat &stat = stats[name];
+    stat.calls++;
+    stat.total += value;
+    stat.max = qMax(stat.max, value);
+}
+
+QString Profiler::summary()
+{
+    QMutexLocker locker(&mutex);
+
+    QStringList lines;
+    QStringList names;
+    foreach (const QByteArray &name, stats.keys())
+        names << QString(name);
+    names.sort();
+
+    lines << QString("%1 %2 %3 %4").arg("", -16).arg("calls", 6)
+                                   .arg("avg ms", 8).arg("max ms", 8);
+    foreach (const QString &name, names) {
+        const Stat &stat = stats[name.toLatin1()];
+        lines << QString("%1 %2 %3 %4").arg(name, -16).arg(stat.calls, 6)
+                 .arg(stat.total / qMax(stat.calls, qint64(1)) / 1e6, 8, 'f', 3)
+                 .arg(stat.max / 1e6, 8, 'f', 3);
+    }
+    // Timings describe the last refresh period; counters are cumulative.
+    stats.clear();
+
+    QHash<QByteArray, qint64>::const_iterator it;
+    for (it = counters.constBegin(); it != counters.constEnd(); ++it)
+        lines << QString("%1 %2").arg(QString(it.key()), -16).arg(it.value(), 6);
+
+    return lines.join("\n");
+}
+
+bool Profiler::exportTrace(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return false;
+
+    QMutexLocker locker(&mutex);
+    QTextStream out(&file);
+    out << "{\"traceEvents\":[\n";
+    for (int i = 0; i < events.size(); ++i) {
+        const TraceEvent &event = events.at(i);
+        out << QString("{\"name\":\"%1\",\"ph\":\"X\",\"pid\":1,\"tid\":%2,"
+                       "\"ts\":%3,\"dur\":%4}")
+               .arg(event.name).arg(event.thread)
+               .arg(event.start / 1000.0, 0, 'f', 3).arg(event.duration / 1000.0, 0, 'f', 3);
+        out << (i + 1 < events.size() || !counters.isEmpty() ? ",\n" : "\n");
+    }
+
+    qint64 ts = now() / 1000;
+    QHash<QByteArray, qint64>::const_iterator it = counters.constBegin();
+    while (it != counters.constEnd()) {
+        out << QString("{\"name\":\"%1\",\"ph\":\"C\",\"pid\":1,\"ts\":%2,\"args\":{\"value\":%3}}")
+               .arg(QString(it.key())).arg(ts).arg(it.value());
+        ++it;
+        out << (it != counters.constEnd() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+
+    return out.status() == QTextStream::Ok;
+}
+
+#endif // SCRIBBLE_PROFILING
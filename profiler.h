@@ -0,0 +1,90 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/*
+ * Hot-path instrumentation. Build with "qmake CONFIG+=profiling" to get
+ * timings, counters and a Chrome trace export; otherwise every macro
+ * below expands to nothing.
+ */
+#ifdef SCRIBBLE_PROFILING
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+class Profiler
+{
+public:
+    static Profiler *instance();
+
+    qint64 now() const { return clock.nsecsElapsed(); }
+    void record(const char *name, qint64 start, qint64 duration);
+    void count(const char *name, qint64 n);
+    void markInput();
+    void markFrame();
+
+    QString summary();
+    bool exportTrace(const QString &fileName);
+
+private:
+    Profiler();
+
+    struct TraceEvent
+    {
+        const char *name;
+        qint64 start;
+        qint64 duration;
+        qint64 thread;
+    };
+    struct Stat
+    {
+        Stat() : calls(0), total(0), max(0) {}
+        qint64 calls;
+        qint64 total;
+        qint64 max;
+    };
+
+    void addStat(const QByteArray &name, qint64 value);
+
+    QMutex mutex;
+    QElapsedTimer clock;
+    QVector<TraceEvent> events;
+    QHash<QByteArray, Stat> stats;
+    QHash<QByteArray, qint64> counters;
+    qint64 firstInput;
+    qint64 lastFrame;
+};
+
+class ProfileScope
+{
+public:
+    ProfileScope(const char *name)
+        : name(name), start(Profiler::instance()->now()) {}
+    ~ProfileScope()
+    { Profiler::instance()->record(name, start, Profiler::instance()->now() - start); }
+
+private:
+    const char *name;
+    qint64 start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_COUNT(name, n) Profiler::instance()->count(name, n)
+#define PROFILE_INPUT() Profiler::instance()->markInput()
+#define PROFILE_FRAME() Profiler::instance()->markFrame()
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, n) do { } while (0)
+#define PROFILE_INPUT() do { } while (0)
+#define PROFILE_FRAME() do { } while (0)
+
+#endif // SCRIBBLE_PROFILING
+
+#endif
@@ -0,0 +1,122 @@
+#include <QMutexLocker>
+#include "profiler.h"
+#include "renderqueue.h"
+
+RenderQueue::RenderQueue(QObject *parent)
+    : QThread(parent), busy(false), stopping(false)
+{
+}
+
+RenderQueue::~RenderQueue()
+{
+    mutex.lock();
+    stopping = true;
+    wakeUp.wakeOne();
+    mutex.unlock();
+    wait();
+}
+
+QRect RenderQueue::paint(const DrawCommand &command, const TiledCanvas &canvas)
+{
+    Job job;
+    job.command = command;
+    job.area = command.boundingRect().intersected(canvas.rect());
+    job.size = canvas.size();
+    job.transparent = canvas.isTransparent();
+    if (job.area.isEmpty())
+        return job.area;
+
+    const QRect &area = job.area;
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+            quint32 key = TiledCanvas::tileKey(tx, ty);
+            if (inFlight.value(key) == 0)
+                job.base.insert(key, canvas.tile(tx, ty));
+            inFlight[key]++;
+        }
+    }
+
+    QMutexLocker locker(&mutex);
+    jobs.append(job);
+    wakeUp.wakeOne();
+    return job.area;
+}
+
+QRect RenderQueue::takeTiles(TiledCanvas *canvas)
+{
+    mutex.lock();
+    QList<QPair<QPoint, QImage> > ready = results;
+    results.clear();
+    mutex.unlock();
+
+    QRect rect;
+    for (int i = 0; i < ready.size(); ++i) {
+        QPoint pos = ready[i].first;
+        canvas->setTile(pos.x(), pos.y(), ready[i].second);
+        rect |= TiledCanvas::tileRect(pos.x(), pos.y());
+
+        quint32 key = TiledCanvas::tileKey(pos.x(), pos.y());
+        if (--inFlight[key] == 0)
+            inFlight.remove(key);
+    }
+    return rect;
+}
+
+void RenderQueue::finish()
+{
+    PROFILE_SCOPE("render.finish");
+    QMutexLocker locker(&mutex);
+    while (!jobs.isEmpty() || busy)
+        idle.wait(&mutex);
+
+    // The canvas is about to change behind our back; forget our copies.
+    working.clear();
+}
+
+void RenderQueue::run()
+{
+    forever {
+        mutex.lock();
+        while (jobs.isEmpty() && !stopping) {
+            idle.wakeAll();
+            wakeUp.wait(&mutex);
+        }
+        if (stopping) {
+            idle.wakeAll();
+            mutex.unlock();
+            break;
+        }
+        Job job = jobs.takeFirst();
+        busy = true;
+        mutex.unlock();
+
+        PROFILE_SCOPE("render.job");
+        const QRect &area = job.area;
+        TiledCanvas target;
+        target.resize(job.size);
+        target.setTransparent(job.transparent);
+        for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+            for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+                quint32 key = TiledCanvas::tileKey(tx, ty);
+                target.setTile(tx, ty, job.base.contains(key) ? job.base.value(key)
+                                                              : working.value(key));
+            }
+        }
+        target.paint(job.command, area);
+
+        QList<QPair<QPoint, QImage> > painted;
+        for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+            for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+                QImage tile = target.tile(tx, ty);
+                working.insert(TiledCanvas::tileKey(tx, ty), tile);
+                painted << qMakePair(QPoint(tx, ty), tile);
+            }
+        }
+
+        mutex.lock();
+        results << painted;
+        busy = false;
+        mutex.unlock();
+        emit tilesReady();
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "drawcommand.h"
+#include "tiledcanvas.h"
+
+/*
+ * Rasterizes draw commands on its own thread. paint() hands over the
+ * command together with the canvas tiles it covers and returns at once;
+ * the painted tiles come back through takeTiles() once tilesReady() is
+ * emitted. A tile that still has a command in flight is taken from the
+ * worker's own copy, so queued commands stack up correctly. Large
+ * commands are split across the thread pool like TiledCanvas::paint().
+ * Anything that touches the canvas directly must call finish() first.
+ */
+class RenderQueue : public QThread
+{
+    Q_OBJECT
+
+public:
+    RenderQueue(QObject *parent = 0);
+    ~RenderQueue();
+
+    QRect paint(const DrawCommand &command, const TiledCanvas &canvas);
+    QRect takeTiles(TiledCanvas *canvas);
+    bool isIdle() const { return inFlight.isEmpty(); }
+    void finish();
+
+signals:
+    void tilesReady();
+
+protected:
+    void run();
+
+private:
+    struct Job
+    {
+        DrawCommand command;
+        QRect area;
+        QSize size;
+        bool transparent;
+        QHash<quint32, QImage> base;
+    };
+
+
+    QMutex mutex;
+    QWaitCondition wakeUp;
+    QWaitCondition idle;
+    QList<Job> jobs;
+    QList<QPair<QPoint, QImage> > results;
+    bool busy;
+    bool stopping;
+
+    QHash<quint32, int> inFlight;
+    QHash<quint32, QImage> working;
+};
+
+#endif
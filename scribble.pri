@@ -0,0 +1,47 @@
+# Drawing engine shared by the application and the benchmark.
+DEPENDPATH += $$PWD
+INCLUDEPATH += $$PWD
+
+profiling {
+    DEFINES += SCRIBBLE_PROFILING
+}
+
+HEADERS += $$PWD/scribblearea.h \
+    $$PWD/common.h \
+    $$PWD/imagehistory.h \
+    $$PWD/tiledcanvas.h \
+    $$PWD/kernels.h \
+    $$PWD/layerstack.h \
+    $$PWD/mipmapcache.h \
+    $$PWD/drawcommand.h \
+    $$PWD/floodfill.h \
+    $$PWD/clipboard.h \
+    $$PWD/floatingselection.h \
+    $$PWD/imagesaver.h \
+    $$PWD/printjob.h \
+    $$PWD/imageloader.h \
+    $$PWD/vectordocument.h \
+    $$PWD/journal.h \
+    $$PWD/renderqueue.h \
+    $$PWD/scribblefile.h \
+    $$PWD/profiler.h \
+    $$PWD/startupprofile.h
+SOURCES += $$PWD/scribblearea.cpp \
+    $$PWD/imagehistory.cpp \
+    $$PWD/tiledcanvas.cpp \
+    $$PWD/kernels.cpp \
+    $$PWD/layerstack.cpp \
+    $$PWD/mipmapcache.cpp \
+    $$PWD/drawcommand.cpp \
+    $$PWD/floodfill.cpp \
+    $$PWD/clipboard.cpp \
+    $$PWD/floatingselection.cpp \
+    $$PWD/imagesaver.cpp \
+    $$PWD/printjob.cpp \
+    $$PWD/imageloader.cpp \
+    $$PWD/vectordocument.cpp \
+    $$PWD/journal.cpp \
+    $$PWD/renderqueue.cpp \
+    $$PWD/scribblefile.cpp \
+    $$PWD/profiler.cpp \
+    $$PWD/startupprofile.cpp
@@ -1,15 +1,9 @@
 ######################################################################
-# Automatically generated by qmake (2.01a) ?? 2? 23 18:25:46 2014
+# Builds the editor, the benchmark and the batch renderer
 ######################################################################
 
-TEMPLATE = app
-TARGET = 
-DEPENDPATH += .
-INCLUDEPATH += .
+TEMPLATE = subdirs
+SUBDIRS = app bench batch
 
-# Input
-HEADERS += mainwindow.h scribblearea.h \
-    common.h
-SOURCES += main.cpp mainwindow.cpp scribblearea.cpp
-RESOURCES += scribble.qrc 
-FORMS += mainwindow.ui
+# The editor's project sits next to this one, among its sources.
+app.file = app.pro
@@ -1,17 +1,36 @@
 #include <QtGui>
+#include <qmath.h>
 #include "scribblearea.h"
+#include "clipboard.h"
+#include "floodfill.h"
+#include "imageloader.h"
+#include "imagesaver.h"
+#include "journal.h"
+#include "printjob.h"
+#include "renderqueue.h"
+#include "startupprofile.h"
+#include "profiler.h"
+
+// A dragging frame whose previews take longer than this switches them to
+// cheap rendering.
+static const qint64 FrameBudget = 12 * 1000 * 1000;
 
 ScribbleArea::ScribbleArea(QWidget *parent)
     : QWidget(parent)
 {
     setMouseTracking(true);
+    setFocusPolicy(Qt::StrongFocus);
     setAttribute(Qt::WA_StaticContents);
     modified = false;
     selected = false;
     scribbling = false;
-    pasting = false;
+    floatDrag = NoFloatDrag;
+    repaintedPixels = 0;
+    repaintTimer.invalidate();
+    framePainted = false;
 
     myPenWidth = 5;
+    myFillTolerance = 32;
     myPenColor = Qt::black;
     myBrushColor = Qt::gray;
     myPenStyle = Qt::SolidLine;
@@ -19,47 +38,481 @@ ScribbleArea::ScribbleArea(QWidget *parent)
 
     myShape = LINE;
 
-    image = QImage(size(), QImage::Format_ARGB32_Premultiplied);
-    image.fill(qRgb(255, 255, 255));
+    canvas.resize(size());
+    zoom = 1.0;
 
-    imageHistory.clear();
-    imageHistory.append(image);
-    idxHistory = 0;
+    history = 0;
+    myHistoryBudget = ImageHistory().memoryBudget();
+    resetHistories();
 
     polyPoints = 0;
+    loader = 0;
+    smoothStrokes = false;
+    adaptivePreview = true;
+    cheapPreview = false;
+    strokeDrawn = 0;
+
+    // Pencil input is drawn at most once per display frame.
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(16);
+    connect(&flushTimer, SIGNAL(timeout()), this, SLOT(flushStroke()));
+
+    renderer = new RenderQueue(this);
+    connect(renderer, SIGNAL(tilesReady()), this, SLOT(takeRenderedTiles()));
+    renderer->start();
+    journal = 0;
+    vectorMode = false;
+    commitPending = false;
+}
+
+ScribbleArea::~ScribbleArea()
+{
+    delete renderer;
+    cancelLoad();
+    qDeleteAll(histories);
+    foreach (ImageSaver *saver, savers)
+        saver->wait();
+#ifndef QT_NO_PRINTER
+    if (printJob) {
+        printJob->cancel();
+        printJob->wait();
+    }
+#endif
+
+    // Without a clean stopJournal() the journal stays for the next start.
+    delete journal;
 }
 
 bool ScribbleArea::openImage(const QString &fileName)
 {
-    QImage loadedImage;
-    if (!loadedImage.load(fileName))
+    if (QFileInfo(fileName).suffix().toLower() == "scrv")
+        return openDocument(fileName);
+
+    QSize imageSize;
+    QList<Layer> nativeLayers;
+    int nativeCurrent = 0;
+    if (ScribbleFile::canRead(fileName)) {
+        ScribbleFile native;
+        if (!native.open(fileName))
+            return false;
+        imageSize = native.size();
+        nativeLayers = native.layers();
+        nativeCurrent = native.currentLayer();
+    } else {
+        QImageReader reader(fileName);
+        if (!reader.canRead())
+            return false;
+        imageSize = reader.size();
+    }
+
+    cancelLoad();
+    syncRender();
+    // Native files bring their layers; their tiles arrive with the bands.
+    if (nativeLayers.isEmpty())
+        layers.reset(&canvas);
+    else
+        layers.restore(nativeLayers, nativeCurrent, &canvas);
+    canvas.clear();
+    canvas.resize(imageSize.expandedTo(size()));
+    modified = false;
+    selected = false;
+    update();
+    emit layersChanged();
+
+    resetHistories();
+    if (journal)
+        journal->checkpoint(layers, canvas);
+
+    // The canvas fills in band by band; drawing waits until it is complete.
+    loader = new ImageLoader(fileName, toCanvas(rect()), this);
+    connect(loader, SIGNAL(bandReady()), this, SLOT(takeLoadedBands()));
+    connect(loader, SIGNAL(finished()), this, SLOT(finishLoad()));
+    setEnabled(false);
+    loader->start();
+
+    return true;
+}
+
+void ScribbleArea::takeLoadedBands()
+{
+    if (!loader)
+        return;
+
+    int layer;
+    QPoint pos;
+    QImage band;
+    while (loader->takeBand(&layer, &pos, &band)) {
+        // Tiles of native files go straight into their layer, no copy.
+        if (pos.x() % TILE_SIZE == 0 && pos.y() % TILE_SIZE == 0
+                && band.size() == QSize(TILE_SIZE, TILE_SIZE)
+                && band.format() == QImage::Format_ARGB32_Premultiplied) {
+            layers.setTile(layer, pos.x() / TILE_SIZE, pos.y() / TILE_SIZE, band, &canvas);
+            updateCanvas(TiledCanvas::tileRect(pos.x() / TILE_SIZE, pos.y() / TILE_SIZE));
+            continue;
+        }
+
+        DrawCommand command(PASTE);
+        command.points << pos;
+        command.image = band;
+        canvas.resize(canvas.size().expandedTo(QSize(pos.x() + band.width(),
+                                                     pos.y() + band.height())));
+        updateCanvas(canvas.paint(command));
+    }
+}
+
+void ScribbleArea::finishLoad()
+{
+    if (!loader || !loader->isFinished())
+        return;
+
+    loader->wait();
+    takeLoadedBands();
+
+    QString fileName = loader->fileName();
+    bool ok = loader->succeeded();
+    loader->deleteLater();
+    loader = 0;
+    setEnabled(true);
+
+    // Saving back to the same native file only writes what changes from here.
+    if (ok && ScribbleFile::canRead(fileName)) {
+        waitForSaves();
+        if (nativeFile.open(fileName))
+            nativeFile.markClean(layers.snapshot(canvas));
+        nativeFile.close();
+    }
+
+    if (journal)
+        journal->checkpoint(layers, canvas);
+    emit loadFinished(fileName, ok);
+}
+
+void ScribbleArea::cancelLoad()
+{
+    if (!loader)
+        return;
+
+    loader->cancel();
+    loader->wait();
+    loader->deleteLater();
+    loader = 0;
+    setEnabled(true);
+}
+
+bool ScribbleArea::openDocument(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    VectorDocument loadedDocument;
+    QSize documentSize;
+    if (!loadedDocument.load(&file, &documentSize))
         return false;
 
-    QSize newSize = loadedImage.size().expandedTo(size());
-    resizeImage(&loadedImage, newSize);
-    image = loadedImage;
+    cancelLoad();
+    syncRender();
+    document = loadedDocument;
+    vectorMode = true;
+    layers.reset(&canvas);
+    canvas.clear();
+    canvas.resize(documentSize.expandedTo(size()));
+    document.render(&canvas, canvas.rect());
     modified = false;
     selected = false;
     update();
 
-    imageHistory.clear();
-    imageHistory.append(image);
-    idxHistory = 0;
+    resetHistories();
+    if (journal)
+        journal->checkpoint(layers, canvas);
+    emit vectorModeChanged(true);
 
     return true;
 }
 
-bool ScribbleArea::saveImage(const QString &fileName, const char *fileFormat)
+bool ScribbleArea::saveDocument(const QString &fileName)
 {
-    QImage visibleImage = image;
-    resizeImage(&visibleImage, size());
+    syncRender();
+    QFile file(fileName);
+    bool ok = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+
+    if (ok && vectorMode) {
+        ok = document.save(&file, canvas.size());
+    } else if (ok) {
+        VectorDocument flat;
+        flat.setBackground(layers.flatten(canvas));
+        ok = flat.save(&file, canvas.size());
+    }
 
-    if (visibleImage.save(fileName, fileFormat)) {
+    if (ok)
         modified = false;
-        return true;
-    } else {
+    emit saveFinished(fileName, ok);
+    return ok;
+}
+
+void ScribbleArea::setVectorMode(bool enabled)
+{
+    if (enabled == vectorMode)
+        return;
+    syncRender();
+
+    // Neither history can replay the other's edits, so both start over.
+    updateCanvas(history->discard(&canvas));
+    history->clear();
+    document.clear();
+    if (enabled)
+        document.setBackground(canvas);
+    vectorMode = enabled;
+    emit vectorModeChanged(enabled);
+}
+
+bool ScribbleArea::saveImage(const QString &fileName, const char *fileFormat)
+{
+    if (QByteArray(fileFormat).toLower() == "scrv")
+        return saveDocument(fileName);
+
+    commitFloating(true);
+    syncRender();
+
+    // Only one thread at a time may write through nativeFile.
+    bool native = QByteArray(fileFormat).toLower() == "scribble";
+    if (native)
+        waitForSaves();
+
+    ImageSaver *saver = new ImageSaver(layers.flatten(canvas), canvas.rect(),
+                                       fileName, fileFormat, this);
+    if (native)
+        saver->setScribbleFile(&nativeFile, layers.snapshot(canvas), layers.current());
+    connect(saver, SIGNAL(progress(int)), this, SIGNAL(saveProgress(int)));
+    connect(saver, SIGNAL(finished()), this, SLOT(reapSaves()));
+    savers.append(saver);
+
+    // Edits made while the file is written mark the image modified again.
+    modified = false;
+    saver->start(QThread::LowPriority);
+    return true;
+}
+
+bool ScribbleArea::waitForSaves()
+{
+    bool ok = true;
+    while (!savers.isEmpty()) {
+        ImageSaver *saver = savers.takeFirst();
+        saver->wait();
+        ok = ok && saver->succeeded();
+        finishSave(saver);
+    }
+    return ok;
+}
+
+void ScribbleArea::reapSaves()
+{
+    for (int i = 0; i < savers.size(); ) {
+        if (savers[i]->isFinished())
+            finishSave(savers.takeAt(i));
+        else
+            ++i;
+    }
+}
+
+void ScribbleArea::finishSave(ImageSaver *saver)
+{
+    saver->wait();
+    if (!saver->succeeded())
+        modified = true;
+    emit saveFinished(saver->fileName(), saver->succeeded());
+    saver->deleteLater();
+}
+
+bool ScribbleArea::recoverJournal(const QString &fileName)
+{
+    QList<Layer> recovered;
+    int current;
+    if (!Journal::recover(fileName, &recovered, &current))
         return false;
+
+    cancelLoad();
+    syncRender();
+    layers.restore(recovered, current, &canvas);
+    canvas.resize(canvas.size().expandedTo(size()));
+    resetHistories();
+    modified = true;
+    selected = false;
+    update();
+    emit layersChanged();
+    return true;
+}
+
+void ScribbleArea::startJournal(const QString &fileName)
+{
+    delete journal;
+    journal = new Journal(fileName, this);
+    journal->start(QThread::LowPriority);
+    journal->checkpoint(layers, canvas);
+}
+
+void ScribbleArea::stopJournal()
+{
+    if (!journal)
+        return;
+
+    QString fileName = journal->fileName();
+    delete journal;
+    journal = 0;
+    Journal::remove(fileName);
+}
+
+void ScribbleArea::takeRenderedTiles()
+{
+    updateCanvas(renderer->takeTiles(&canvas));
+
+    // The revision of the last edit is cut once all of its tiles are back.
+    if (commitPending && renderer->isIdle()) {
+        commitPending = false;
+        history->commit(canvas);
+    }
+}
+
+void ScribbleArea::syncRender()
+{
+    renderer->finish();
+    takeRenderedTiles();
+}
+
+void ScribbleArea::syncJournal()
+{
+    if (journal && journal->needsCheckpoint()) {
+        // Records before the checkpoint are dropped, so their tiles must be in it.
+        syncRender();
+        journal->checkpoint(layers, canvas);
+    }
+}
+
+void ScribbleArea::addLayer()
+{
+    prepareLayerSwitch();
+    layers.add(tr("Layer %1").arg(layers.count()), &canvas);
+    histories.insert(layers.current(), createHistory());
+    history = histories[layers.current()];
+    finishLayerEdit(true);
+}
+
+void ScribbleArea::removeLayer()
+{
+    if (layers.count() < 2)
+        return;
+
+    prepareLayerSwitch();
+    delete histories.takeAt(layers.current());
+    layers.remove(&canvas);
+    history = histories[layers.current()];
+    finishLayerEdit(true);
+}
+
+void ScribbleArea::setCurrentLayer(int i)
+{
+    if (i == layers.current())
+        return;
+
+    prepareLayerSwitch();
+    layers.setCurrent(i, &canvas);
+    history = histories[layers.current()];
+    finishLayerEdit(true);
+}
+
+void ScribbleArea::raiseLayer()
+{
+    moveLayer(layers.current() + 1);
+}
+
+void ScribbleArea::lowerLayer()
+{
+    moveLayer(layers.current() - 1);
+}
+
+void ScribbleArea::moveLayer(int to)
+{
+    int from = layers.current();
+    if (to < 0 || to >= layers.count())
+        return;
+
+    layers.move(from, to, &canvas);
+    histories.move(from, to);
+    if (journal)
+        journal->recordLayerMove(from, to);
+    finishLayerEdit(false);
+}
+
+void ScribbleArea::setLayerOpacity(int percent)
+{
+    layers.setOpacity(layers.current(), percent / 100.0);
+    recordLayer();
+    finishLayerEdit(false);
+}
+
+void ScribbleArea::setLayerVisible(bool visible)
+{
+    layers.setVisible(layers.current(), visible);
+    recordLayer();
+    finishLayerEdit(false);
+}
+
+void ScribbleArea::setLayerBlendMode(int mode)
+{
+    layers.setBlendMode(layers.current(), QPainter::CompositionMode(mode));
+    recordLayer();
+    finishLayerEdit(false);
+}
+
+void ScribbleArea::recordLayer()
+{
+    if (journal)
+        journal->recordLayer(layers.current(), layers.layer(layers.current()));
+}
+
+void ScribbleArea::prepareLayerSwitch()
+{
+    commitFloating(true);
+    syncRender();
+    // Each layer keeps its own undo history; only the vector document is
+    // tied to the current layer. Touched but uncommitted tiles go back.
+    updateCanvas(history->discard(&canvas));
+}
+
+void ScribbleArea::resetHistories()
+{
+    qDeleteAll(histories);
+    histories.clear();
+    for (int i = 0; i < layers.count(); ++i)
+        histories << createHistory();
+    history = histories[layers.current()];
+}
+
+ImageHistory *ScribbleArea::createHistory() const
+{
+    // Compressed revisions get a third of the live budget before they spill.
+    ImageHistory *layerHistory = new ImageHistory;
+    layerHistory->setBudget(myHistoryBudget, myHistoryBudget / 3);
+    return layerHistory;
+}
+
+void ScribbleArea::finishLayerEdit(bool switched)
+{
+    if (switched && vectorMode) {
+        document.clear();
+        document.setBackground(canvas);
     }
+
+    // Later records land on whichever layer is current, so a switch starts
+    // a fresh checkpoint. It drops the queued records, so the tiles they
+    // painted must be in it.
+    if (switched && journal) {
+        syncRender();
+        journal->checkpoint(layers, canvas);
+    }
+    modified = true;
+    update();
+    emit layersChanged();
 }
 
 void ScribbleArea::setPenColor(const QColor &newColor)
@@ -77,6 +530,33 @@ void ScribbleArea::setPenWidth(int newWidth)
     myPenWidth = newWidth;
 }
 
+void ScribbleArea::setAdaptivePreview(bool enabled)
+{
+    adaptivePreview = enabled;
+    cheapPreview = false;
+}
+
+void ScribbleArea::setSmoothStrokes(bool enabled)
+{
+    smoothStrokes = enabled;
+}
+
+void ScribbleArea::setHistoryBudget(qint64 bytes)
+{
+    // Compressed revisions get a third of the live budget before they spill.
+    myHistoryBudget = bytes;
+    foreach (ImageHistory *layerHistory, histories)
+        layerHistory->setBudget(bytes, bytes / 3);
+}
+
+qint64 ScribbleArea::historyBytes() const
+{
+    qint64 bytes = 0;
+    foreach (ImageHistory *layerHistory, histories)
+        bytes += layerHistory->byteCount();
+    return bytes;
+}
+
 void ScribbleArea::setPenStyle(const Qt::PenStyle newPenStyle)
 {
     myPenStyle = newPenStyle;
@@ -89,222 +569,700 @@ void ScribbleArea::setBrushStyle(const Qt::BrushStyle newBrushStyle)
 
 void ScribbleArea::setShape(const Shape newShape)
 {
+    commitFloating(true);
     myShape = newShape;
 }
 
 void ScribbleArea::clearImage()
 {
-    image.fill(qRgb(255, 255, 255));
+    cancelFloating();
+    syncRender();
+    history->discard(&canvas);
+    history->touch(canvas, canvas.rect());
+    canvas.clear();
     modified = true;
-    imageHistory.append(image);
-    idxHistory++;
+    if (journal)
+        journal->recordClear(canvas.size());
+
+    finishCommand(clearCommand(canvas.rect()));
     update();
 }
 
 
 void ScribbleArea::mousePressEvent(QMouseEvent *event)
 {
+    PROFILE_INPUT();
+    PROFILE_SCOPE("mousePressEvent");
+    if (event->button() == Qt::MidButton) {
+        panStart = event->pos();
+        return;
+    }
+
+    QPoint pos = toCanvas(event->pos());
     if (event->button() == Qt::LeftButton) {
+        // Dragging a selection floats it; clicking elsewhere drops it.
+        if (floating.contains(pos)
+                || (selected && myShape == SELECT && selectedArea.normalized().contains(pos))) {
+            if (!floating.isActive())
+                liftSelection();
+            if (event->modifiers() & Qt::ShiftModifier)
+                floatDrag = ScaleFloat;
+            else if (event->modifiers() & Qt::ControlModifier)
+                floatDrag = RotateFloat;
+            else
+                floatDrag = MoveFloat;
+            floatStart = pos;
+            floatStartPos = floating.pos();
+            floatStartScale = floating.scale();
+            floatStartAngle = floating.angle();
+            return;
+        }
+        commitFloating(true);
+
         if (selected) {
-            image = imageHistory[idxHistory];
-            update();
+            updateCanvas(selectionRect());
             selected = false;
         }
 
+        if (myShape == FILL) {
+            syncRender();
+            DrawCommand command = FloodFill::command(canvas, pos, myBrushColor, myFillTolerance);
+            if (!command.points.isEmpty()) {
+                commitCommand(command);
+                modified = true;
+            }
+            return;
+        }
+
         if (myShape == SELECT) selected = true;
 
-        lastPoint = event->pos();
+        lastPoint = pos;
+        previewPoint = pos;
         scribbling = true;
-    }
-
-    if (pasting) {
-        QPainter painter(&image);
-        painter.drawImage(event->pos(), qApp->clipboard()->image());
-        update();
-
-        togglePasting();
-        modified = true;
 
-        imageHistory.erase(imageHistory.begin() + idxHistory+1, imageHistory.end());
-        imageHistory.append(image);
-        idxHistory++;
-
-        lastPoint = event->pos();
+        stroke = shapeCommand(lastPoint, lastPoint, myShape);
+        stroke.points.resize(1);
+        strokeInput.clear();
+        strokeInput << lastPoint;
+        strokeDrawn = 0;
     }
 }
 
 void ScribbleArea::mouseMoveEvent(QMouseEvent *event)
 {
-    if ((event->buttons() & Qt::LeftButton) && scribbling) {
-        if (myShape != PENCIL && myShape != ERASER)
-            image = imageHistory[idxHistory];
-        drawShape(event->pos(), myShape);
+    PROFILE_INPUT();
+    PROFILE_SCOPE("mouseMoveEvent");
+    if (event->buttons() & Qt::MidButton) {
+        panBy(event->pos() - panStart);
+        panStart = event->pos();
+        return;
     }
 
-    if (pasting) {
-        image = imageHistory[idxHistory];
+    QPoint pos = toCanvas(event->pos());
+    if ((event->buttons() & Qt::LeftButton) && floatDrag != NoFloatDrag) {
+        QRect dirtyRect = floating.boundingRect() | floating.sourceRect();
+        QLineF from(floating.center(), floatStart);
+        QLineF to(floating.center(), pos);
+        if (floatDrag == MoveFloat)
+            floating.moveTo(floatStartPos + pos - floatStart);
+        else if (floatDrag == ScaleFloat && from.length() > 0)
+            floating.setScale(floatStartScale * to.length() / from.length());
+        else if (floatDrag == RotateFloat && from.length() > 0 && to.length() > 0)
+            floating.setAngle(floatStartAngle - from.angleTo(to));
+        updateCanvas(dirtyRect | floating.boundingRect());
+        return;
+    }
 
-        QPainter painter(&image);
-        painter.drawImage(event->pos(), qApp->clipboard()->image());
-        update();
+    if ((event->buttons() & Qt::LeftButton) && scribbling) {
+        if (myShape == PENCIL || myShape == ERASER) {
+            // Points are buffered and drawn once per frame, see flushStroke().
+            strokeInput << pos;
+            if (!flushTimer.isActive())
+                flushTimer.start();
+        } else {
+            QRect dirtyRect = shapeCommand(lastPoint, previewPoint, myShape).boundingRect();
+            previewPoint = pos;
+            updateCanvas(dirtyRect | shapeCommand(lastPoint, previewPoint, myShape).boundingRect());
+        }
     }
 }
 
 void ScribbleArea::mouseReleaseEvent(QMouseEvent *event)
 {
+    PROFILE_INPUT();
+    PROFILE_SCOPE("mouseReleaseEvent");
+    QPoint pos = toCanvas(event->pos());
+    if (event->button() == Qt::LeftButton)
+        cheapPreview = false;
+
+    if (event->button() == Qt::LeftButton && floatDrag != NoFloatDrag) {
+        // Redraw with the smooth transform now the drag is over.
+        floatDrag = NoFloatDrag;
+        updateCanvas(floating.boundingRect());
+        return;
+    }
+
     if (event->button() == Qt::LeftButton && scribbling) {
         if (myShape == TEXT) {
             bool ok;
-            QPainter painter(&image);
             QString text = QInputDialog::getText(this, tr("Input text"),
                                                       tr("Please input a text:"), QLineEdit::Normal,
                                                       "Hello for NMLab", &ok);
-            if (ok && !text.isEmpty()) painter.drawText(lastPoint, text);
-        } else { drawShape(event->pos(), myShape); }
+            if (ok && !text.isEmpty()) {
+                DrawCommand command(TEXT);
+                command.pen = QPen(Qt::black);
+                command.points << lastPoint;
+                command.text = text;
+                commitCommand(command);
+            }
+        } else if (selected) {
+            updateCanvas(shapeCommand(lastPoint, previewPoint, SELECT).boundingRect());
+            selectedArea = QRect(lastPoint, pos);
+
+            // A plain click in vector mode picks the item under the cursor.
+            int item = (vectorMode && lastPoint == pos)
+                       ? document.itemAt(pos) : -1;
+            if (item >= 0) {
+                QRect area = document.item(item).boundingRect().intersected(canvas.rect());
+                selectedArea = QRect(area.topLeft(), area.bottomRight());
+            }
+
+            updateCanvas(selectionRect());
+        } else {
+            DrawCommand command;
+            if (myShape == PENCIL || myShape == ERASER) {
+                strokeInput << pos;
+                drawStroke(true);
+                command = stroke;
+            } else {
+                updateCanvas(shapeCommand(lastPoint, previewPoint, myShape).boundingRect());
+                command = shapeCommand(lastPoint, pos, myShape);
+                drawShape(pos, myShape);
+            }
+            if (journal)
+                journal->record(command);
+            syncJournal();
+            finishCommand(command);
+        }
 
         scribbling = false;
         modified = true;
 
-        if (selected) {
+        if (selected)
             modified = false;
-            selectedArea = QRect(lastPoint, event->pos());
-            selectedImage = imageHistory[idxHistory].copy(QRect(lastPoint, event->pos()));
-        } else {
-            imageHistory.erase(imageHistory.begin() + idxHistory+1, imageHistory.end());
-            imageHistory.append(image);
-            idxHistory++;
-        }
 
-        lastPoint = event->pos();
+        lastPoint = pos;
     }
 }
 
 void ScribbleArea::paintEvent(QPaintEvent *event)
 {
+    PROFILE_SCOPE("paintEvent");
     QPainter painter(this);
-    QRect dirtyRect = event->rect();
-    painter.drawImage(dirtyRect, image, dirtyRect);
+    bool actualSize = zoom == 1.0;
+    const TiledCanvas &shown = shownCanvas();
+    foreach (const QRect &dirtyRect, event->region().rects()) {
+        if (actualSize) {
+            painter.save();
+            painter.translate(origin);
+            layers.draw(&painter, dirtyRect.translated(-origin), shown);
+            painter.restore();
+        } else {
+            // Zoomed views come from the mipmap level closest to the zoom.
+            QRect area = toCanvas(dirtyRect).intersected(canvas.rect());
+            const TiledCanvas &composite = layers.flatten(shown, area);
+            painter.fillRect(dirtyRect, Qt::white);
+            mipmaps.draw(&painter, composite, area, zoom, origin, !cheapPreview);
+        }
+        repaintedPixels += qint64(dirtyRect.width()) * dirtyRect.height();
+    }
+    if (!actualSize)
+        mipmaps.trim();
+
+    if (!repaintTimer.isValid()) {
+        repaintTimer.start();
+        QTimer::singleShot(1000, this, SLOT(reportRepaintRate()));
+    }
+
+    // Rubber-band shapes and the selection outline live only on screen
+    // until they are committed, so dragging never touches the canvas.
+    // Only they are timed; the tile blit costs the same either way.
+    QElapsedTimer previewTimer;
+    previewTimer.start();
+    painter.translate(origin);
+    painter.scale(zoom, zoom);
+    if (floating.isActive()) {
+        floating.draw(&painter, floatDrag == NoFloatDrag && !cheapPreview, !cheapPreview);
+    }
+    if (scribbling && myShape != PENCIL && myShape != ERASER)
+        previewCommand(shapeCommand(lastPoint, previewPoint, myShape)).paint(&painter);
+    else if (selected)
+        previewCommand(shapeCommand(selectedArea.topLeft(), selectedArea.bottomRight(), SELECT))
+                .paint(&painter);
+
+    // Once a drag misses the budget it stays cheap until the button is
+    // released, rather than flipping between the two looks.
+    bool dragging = scribbling || floatDrag != NoFloatDrag;
+    if (adaptivePreview && dragging && previewTimer.nsecsElapsed() > FrameBudget)
+        cheapPreview = true;
+
+    PROFILE_FRAME();
+    StartupProfile::firstFrame();
+    if (!framePainted) {
+        framePainted = true;
+        emit firstFramePainted();
+    }
+}
+
+void ScribbleArea::keyPressEvent(QKeyEvent *event)
+{
+    if (!floating.isActive()) {
+        QWidget::keyPressEvent(event);
+        return;
+    }
+
+    switch (event->key()) {
+        case Qt::Key_Return:
+        case Qt::Key_Enter:
+            commitFloating(true);
+            break;
+        case Qt::Key_Escape:
+            cancelFloating();
+            break;
+        case Qt::Key_Delete:
+            commitFloating(false);
+            break;
+        default:
+            QWidget::keyPressEvent(event);
+            break;
+    }
+}
+
+void ScribbleArea::wheelEvent(QWheelEvent *event)
+{
+    if (event->modifiers() & Qt::ControlModifier) {
+        setZoom(zoom * ((event->delta() > 0) ? 1.25 : 0.8), event->pos());
+    } else if (event->orientation() == Qt::Horizontal
+               || (event->modifiers() & Qt::ShiftModifier)) {
+        panBy(QPoint(event->delta() / 2, 0));
+    } else {
+        panBy(QPoint(0, event->delta() / 2));
+    }
+    event->accept();
+}
+
+void ScribbleArea::setZoom(qreal factor)
+{
+    setZoom(factor, rect().center());
+}
+
+void ScribbleArea::setZoom(qreal factor, const QPoint &anchor)
+{
+    factor = qBound(0.1, factor, 32.0);
+    if (factor == zoom)
+        return;
+
+    // Keep the canvas point under the anchor where it is.
+    QPointF fixed = (QPointF(anchor) - origin) / zoom;
+    zoom = factor;
+    origin = anchor - (fixed * zoom).toPoint();
+    update();
+    emit zoomChanged(zoom);
+}
+
+void ScribbleArea::panBy(const QPoint &delta)
+{
+    origin += delta;
+    update();
+}
+
+QPoint ScribbleArea::toCanvas(const QPoint &pos) const
+{
+    QPointF p = QPointF(pos - origin) / zoom;
+    return QPoint(qFloor(p.x()), qFloor(p.y()));
+}
+
+QRect ScribbleArea::toCanvas(const QRect &rect) const
+{
+    return QRect(toCanvas(rect.topLeft()), toCanvas(rect.bottomRight()));
+}
+
+QRect ScribbleArea::toWidget(const QRect &rect) const
+{
+    int left = qFloor(rect.left() * zoom) + origin.x();
+    int top = qFloor(rect.top() * zoom) + origin.y();
+    int right = qCeil((rect.right() + 1) * zoom) + origin.x();
+    int bottom = qCeil((rect.bottom() + 1) * zoom) + origin.y();
+    return QRect(QPoint(left, top), QPoint(right - 1, bottom - 1));
+}
+
+void ScribbleArea::updateCanvas(const QRect &rect)
+{
+    if (!rect.isEmpty())
+        update(toWidget(rect));
+}
+
+void ScribbleArea::reportRepaintRate()
+{
+    qint64 elapsed = qMax(repaintTimer.elapsed(), qint64(1));
+    emit repaintRateChanged(repaintedPixels * 1000 / elapsed);
+
+    // Keep sampling while there is activity, so an idle canvas reports 0 once.
+    if (repaintedPixels > 0) {
+        repaintedPixels = 0;
+        repaintTimer.restart();
+        QTimer::singleShot(1000, this, SLOT(reportRepaintRate()));
+    } else {
+        repaintTimer.invalidate();
+    }
 }
 
 void ScribbleArea::resizeEvent(QResizeEvent *event)
 {
-    if (width() > image.width() || height() > image.height()) {
-        int newWidth = qMax(width() + 128, image.width());
-        int newHeight = qMax(height() + 128, image.height());
-        resizeImage(&image, QSize(newWidth, newHeight));
-        update();
+    if (width() > canvas.width() || height() > canvas.height()) {
+        canvas.resize(canvas.size().expandedTo(size()));
+        if (journal)
+            journal->recordResize(canvas.size());
     }
     QWidget::resizeEvent(event);
 }
 
 void ScribbleArea::drawShape(const QPoint endPoint, const Shape shape)
 {
-    QPainter painter(&image);
+    PROFILE_SCOPE("drawShape");
+    DrawCommand command = shapeCommand(lastPoint, endPoint, shape);
+    touchHistory(command.boundingRect());
+    renderer->paint(command, canvas);
+}
+
+void ScribbleArea::flushStroke()
+{
+    if (scribbling && (myShape == PENCIL || myShape == ERASER))
+        drawStroke(false);
+}
+
+void ScribbleArea::drawStroke(bool final)
+{
+    PROFILE_SCOPE("drawStroke");
+    flushTimer.stop();
+
+    // A smoothed segment needs the point after it, so the last one waits.
+    int end = strokeInput.size() - 1;
+    if (smoothStrokes && !final)
+        end--;
+    if (end <= strokeDrawn)
+        return;
+    PROFILE_COUNT("stroke points", end - strokeDrawn);
+
+    DrawCommand command = shapeCommand(strokeInput[strokeDrawn], strokeInput[strokeDrawn],
+                                       myShape);
+    command.points.resize(1);
+    for (int i = strokeDrawn; i < end; ++i) {
+        if (smoothStrokes)
+            command.points << splineSegment(i);
+        else
+            command.points << strokeInput[i + 1];
+    }
+    strokeDrawn = end;
+
+    // One painter pass and one dirty rect for everything since the last
+    // frame, done by the render thread; the tiles show up in takeRenderedTiles().
+    touchHistory(command.boundingRect());
+    renderer->paint(command, canvas);
+    stroke.points << command.points.mid(1);
+    lastPoint = command.points.last();
+}
+
+QPolygon ScribbleArea::splineSegment(int i) const
+{
+    // Catmull-Rom through the input points, sampled every few pixels.
+    QPointF p0 = strokeInput[qMax(i - 1, 0)];
+    QPointF p1 = strokeInput[i];
+    QPointF p2 = strokeInput[i + 1];
+    QPointF p3 = strokeInput[qMin(i + 2, strokeInput.size() - 1)];
+
+    QLineF chord(p1, p2);
+    int steps = qBound(1, int(chord.length() / 4), 32);
+    QPolygon points;
+    for (int step = 1; step <= steps; ++step) {
+        qreal t = qreal(step) / steps;
+        qreal t2 = t * t;
+        qreal t3 = t2 * t;
+        QPointF p = 0.5 * ((2 * p1) + (-p0 + p2) * t
+                           + (2 * p0 - 5 * p1 + 4 * p2 - p3) * t2
+                           + (-p0 + 3 * p1 - 3 * p2 + p3) * t3);
+        points << p.toPoint();
+    }
+    return points;
+}
+
+// A new edit must not land in the revision of one still being rendered.
+void ScribbleArea::touchHistory(const QRect &rect)
+{
+    if (commitPending)
+        syncRender();
+    history->touch(canvas, rect);
+}
+
+void ScribbleArea::commitCommand(const DrawCommand &command)
+{
+    touchHistory(command.boundingRect());
+    if (command.shape == TEXT && !QFontDatabase::supportsThreadedFontRendering()) {
+        // Fonts only work on the GUI thread here; queued tiles land first.
+        syncRender();
+        updateCanvas(canvas.paint(command, QRect(), false));
+    } else {
+        renderer->paint(command, canvas);
+    }
+    if (journal)
+        journal->record(command);
+    syncJournal();
+    finishCommand(command);
+}
+
+void ScribbleArea::finishCommand(const DrawCommand &command)
+{
+    if (vectorMode) {
+        document.add(command);
+        history->clear();
+    } else {
+        commitPending = true;
+        takeRenderedTiles();
+    }
+}
+
+DrawCommand ScribbleArea::shapeCommand(const QPoint startPoint, const QPoint endPoint,
+                                       const Shape shape) const
+{
+    DrawCommand command(shape);
     QColor color = (shape == ERASER)? myBrushColor : myPenColor;
 
     if (shape == SELECT) {
-        painter.setPen(QPen(Qt::black, 1, Qt::DashLine, Qt::FlatCap, Qt::BevelJoin));
-        painter.setBrush(QBrush(Qt::NoBrush));
+        command.pen = QPen(Qt::black, 1, Qt::DashLine, Qt::FlatCap, Qt::BevelJoin);
+        command.brush = QBrush(Qt::NoBrush);
     } else {
-        painter.setPen(QPen(color, myPenWidth, myPenStyle, Qt::RoundCap, Qt::RoundJoin));
-        painter.setBrush(QBrush(myBrushColor, myBrushStyle));
+        command.pen = QPen(color, myPenWidth, myPenStyle, Qt::RoundCap, Qt::RoundJoin);
+        command.brush = QBrush(myBrushColor, myBrushStyle);
     }
 
-    QPoint p = endPoint - lastPoint;
-    switch (shape)
-    {
-        case ERASER:
-        case PENCIL:
-            painter.drawLine(lastPoint, endPoint);
-            lastPoint = endPoint;
-            break;
-        case LINE:
-            painter.drawLine(lastPoint, endPoint);
-            break;
-        case SELECT:
-        case RECT:
-            painter.drawRect(QRect(lastPoint, endPoint));
-            break;
-        case ROUNDRECT:
-            painter.drawRoundedRect(QRect(lastPoint, endPoint),
-                                    p.x()*10/100,
-                                    p.y()*10/100       );
-            break;
-        case ELLIPSE:
-            painter.drawEllipse(QRect(lastPoint, endPoint));
-            break;
-        //case POLYGON:
-        //case TEXT:
+    command.points << startPoint << endPoint;
+    return command;
+}
 
-        //case CURVE:
-        //case PIE:
-        default:
-            break;
+// Cleared areas go back to the layer's background: white paper on the
+// bottom layer, transparency above it.
+DrawCommand ScribbleArea::clearCommand(const QRect &rect) const
+{
+    DrawCommand command(RECT);
+    command.brush = QBrush(canvas.isTransparent() ? Qt::transparent : Qt::white);
+    command.points << rect.topLeft() << rect.bottomRight();
+    return command;
+}
+
+// Lifted pixels leave their source on the canvas until they are dropped,
+// so the current layer is shown as it will be by then: cleared under the
+// source and composited with the others as usual.
+const TiledCanvas &ScribbleArea::shownCanvas()
+{
+    QRect source = floating.sourceRect().intersected(canvas.rect());
+    if (!floating.isLifted() || source.isEmpty()) {
+        liftedCanvas = TiledCanvas();
+        liftedKeys.clear();
+        liftedTiles.clear();
+        return canvas;
     }
 
-    update();
+    QList<qint64> keys;
+    for (int ty = source.top() / TILE_SIZE; ty <= source.bottom() / TILE_SIZE; ++ty)
+        for (int tx = source.left() / TILE_SIZE; tx <= source.right() / TILE_SIZE; ++tx)
+            keys << canvas.tile(tx, ty).cacheKey();
+
+    // The cleared tiles are kept while their sources are, so the composite
+    // of a dragged selection is not blended again every frame.
+    bool rebuild = source != liftedSource || keys != liftedKeys;
+    if (rebuild) {
+        liftedSource = source;
+        liftedKeys = keys;
+        liftedTiles.clear();
+    }
+    DrawCommand clear = clearCommand(source);
+    liftedCanvas = canvas;
+    int i = 0;
+    for (int ty = source.top() / TILE_SIZE; ty <= source.bottom() / TILE_SIZE; ++ty) {
+        for (int tx = source.left() / TILE_SIZE; tx <= source.right() / TILE_SIZE; ++tx, ++i) {
+            if (rebuild) {
+                QImage tile = canvas.tile(tx, ty);
+                TiledCanvas::paintTile(&tile, tx, ty, clear, source, canvas.isTransparent());
+                liftedTiles << tile;
+            }
+            liftedCanvas.setTile(tx, ty, liftedTiles.at(i));
+        }
+    }
+    return liftedCanvas;
 }
 
-void ScribbleArea::resizeImage(QImage *image, const QSize &newSize)
+DrawCommand ScribbleArea::previewCommand(DrawCommand command) const
 {
-    if (image->size() == newSize)
+    if (!cheapPreview)
+        return command;
+
+    // Solid outlines with plain ends are much cheaper to stroke than
+    // dashed, round-capped ones, and a flat fill than a pattern, gradient
+    // or texture; the committed shape keeps the real pen and brush.
+    if (command.pen.style() != Qt::NoPen)
+        command.pen.setStyle(Qt::SolidLine);
+    command.pen.setCapStyle(Qt::FlatCap);
+    command.pen.setJoinStyle(Qt::BevelJoin);
+    command.pen.setBrush(command.pen.color());
+    if (command.brush.style() != Qt::NoBrush)
+        command.brush = QBrush(command.brush.color());
+    return command;
+}
+
+QRect ScribbleArea::selectionRect() const
+{
+    return shapeCommand(selectedArea.topLeft(), selectedArea.bottomRight(), SELECT).boundingRect();
+}
+
+void ScribbleArea::liftSelection()
+{
+    syncRender();
+    QRect area = selectedArea.normalized().intersected(canvas.rect());
+    updateCanvas(selectionRect());
+    selected = false;
+    floating.lift(canvas.copy(area), area.topLeft(), area);
+    updateCanvas(floating.boundingRect());
+}
+
+void ScribbleArea::commitFloating(bool keepPixels)
+{
+    if (!floating.isActive())
         return;
 
-    QImage newImage(newSize, QImage::Format_RGB32);
-    newImage.fill(qRgb(255, 255, 255));
-    QPainter painter(&newImage);
-    painter.drawImage(QPoint(0, 0), *image);
-    *image = newImage;
+    QList<DrawCommand> commands;
+    if (floating.isLifted())
+        commands << clearCommand(floating.sourceRect());
+    if (keepPixels)
+        commands << floating.pasteCommand();
+    cancelFloating();
+    if (commands.isEmpty())
+        return;
+
+    // Lifting and dropping the pixels is a single undo step.
+    syncRender();
+    foreach (const DrawCommand &command, commands) {
+        history->touch(canvas, command.boundingRect());
+        renderer->paint(command, canvas);
+        if (journal)
+            journal->record(command);
+        if (vectorMode)
+            document.add(command);
+    }
+    syncJournal();
+    if (vectorMode) {
+        history->clear();
+    } else {
+        commitPending = true;
+        takeRenderedTiles();
+    }
+    modified = true;
+}
+
+void ScribbleArea::cancelFloating()
+{
+    if (!floating.isActive())
+        return;
+    updateCanvas(floating.boundingRect() | floating.sourceRect());
+    floating.clear();
+    floatDrag = NoFloatDrag;
+}
+
+void ScribbleArea::pasteClipboard()
+{
+    QImage image = Clipboard::image();
+    if (image.isNull())
+        return;
+
+    commitFloating(true);
+    if (selected) {
+        selected = false;
+        updateCanvas(selectionRect());
+    }
+
+    // Pasted pixels float in the middle of the view until dropped.
+    floating.lift(image, toCanvas(rect()).center() - image.rect().center());
+    updateCanvas(floating.boundingRect());
 }
 
 void ScribbleArea::print()
 {
 #ifndef QT_NO_PRINTER
-    QPrinter printer(QPrinter::HighResolution);
- 
-    QPrintDialog *printDialog = new QPrintDialog(&printer, this);
-    if (printDialog->exec() == QDialog::Accepted) {
-        QPainter painter(&printer);
-        QRect rect = painter.viewport();
-        QSize size = image.size();
-        size.scale(rect.size(), Qt::KeepAspectRatio);
-        painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
-        painter.setWindow(image.rect());
-        painter.drawImage(0, 0, image);
+    if (printJob)
+        return;
+
+    QPrinter *printer = new QPrinter(QPrinter::HighResolution);
+    QPrintDialog printDialog(printer, this);
+    if (printDialog.exec() != QDialog::Accepted) {
+        delete printer;
+        return;
     }
+
+    // The job prints a snapshot, so drawing can go on meanwhile.
+    commitFloating(true);
+    syncRender();
+    printJob = new PrintJob(layers.flatten(canvas), printer, this);
+
+    QProgressDialog *progress = new QProgressDialog(tr("Printing..."), tr("Cancel"), 0, 100, this);
+    progress->setMinimumDuration(500);
+    connect(printJob, SIGNAL(progress(int)), progress, SLOT(setValue(int)));
+    connect(progress, SIGNAL(canceled()), printJob, SLOT(cancel()));
+    connect(printJob, SIGNAL(finished()), progress, SLOT(deleteLater()));
+    connect(printJob, SIGNAL(finished()), printJob, SLOT(deleteLater()));
+    printJob->start();
 #endif // QT_NO_PRINTER
 }
 
-void ScribbleArea::moveHistory(int x)
+bool ScribbleArea::moveHistory(int x)
 {
-    if ( (idxHistory + x) < 0 || (idxHistory + x) >= imageHistory.size() )
-        return;
+    cancelFloating();
+    syncRender();
+    QRect rect;
+    bool ok = true;
+    if (vectorMode) {
+        updateCanvas(history->discard(&canvas));
+        rect = document.move(&canvas, x);
+    } else {
+        rect = history->move(&canvas, x, &ok);
+    }
 
-    idxHistory += x;
-    image = imageHistory[idxHistory];
-    update();
+    updateCanvas(rect);
+    if (journal)
+        journal->recordTiles(rect, canvas);
+    syncJournal();
+    return ok;
 }
 
 void ScribbleArea::copySelectedImage()
 {
-    qApp->clipboard()->setImage(selectedImage);
+    // Both share pixels with the canvas; nothing is copied until a paste.
+    syncRender();
+    if (floating.isActive())
+        Clipboard::setImage(floating.pasteCommand().image);
+    else
+        Clipboard::setCanvas(canvas, selectedArea.normalized());
 }
 
 void ScribbleArea::clearSelected(bool clearArea)
 {
-    image = imageHistory[idxHistory];
-    selected = false;
-    update();
+    if (floating.isActive()) {
+        if (clearArea)
+            commitFloating(false);
+        return;
+    }
 
-    if (clearArea) {
-        QPainter painter(&image);
-        painter.setPen(QPen(Qt::NoPen));
-        painter.setBrush(QBrush(Qt::white));
-        painter.drawRect(selectedArea);
-        update();
+    selected = false;
+    updateCanvas(selectionRect());
 
-        imageHistory.erase(imageHistory.begin() + idxHistory+1, imageHistory.end());
-        imageHistory.append(image);
-        idxHistory++;
-    }
+    if (clearArea)
+        commitCommand(clearCommand(QRect(selectedArea.topLeft(), selectedArea.bottomRight())));
 }
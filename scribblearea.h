@@ -2,11 +2,28 @@
 #define SCRIBBLEAREA_H
 
 #include <QColor>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <QImage>
 #include <QPoint>
+#include <QPointer>
 #include <QWidget>
 
 #include "common.h"
+#include "drawcommand.h"
+#include "floatingselection.h"
+#include "imagehistory.h"
+#include "layerstack.h"
+#include "mipmapcache.h"
+#include "scribblefile.h"
+#include "tiledcanvas.h"
+#include "vectordocument.h"
+
+class ImageLoader;
+class PrintJob;
+class Journal;
+class RenderQueue;
+class ImageSaver;
 
 class ScribbleArea : public QWidget
 {
@@ -14,9 +31,23 @@ class ScribbleArea : public QWidget
 
 public:
     ScribbleArea(QWidget *parent = 0);
+    ~ScribbleArea();
 
     bool openImage(const QString &fileName);
     bool saveImage(const QString &fileName, const char *fileFormat);
+    bool isVectorMode() const { return vectorMode; }
+    bool isSmoothingStrokes() const { return smoothStrokes; }
+    bool isAdaptivePreview() const { return adaptivePreview; }
+    qreal zoomFactor() const { return zoom; }
+    const LayerStack &layerStack() const { return layers; }
+    qint64 historyBytes() const;
+    qint64 historyBudget() const { return myHistoryBudget; }
+    void setHistoryBudget(qint64 bytes);
+    bool isSaving() const { return !savers.isEmpty(); }
+    bool waitForSaves();
+    bool recoverJournal(const QString &fileName);
+    void startJournal(const QString &fileName);
+    void stopJournal();
     void setPenColor(const QColor &newColor);
     void setBrushColor(const QColor &newColor);
     void setPenWidth(int newWidth);
@@ -24,23 +55,48 @@ public:
     void setBrushStyle(const Qt::BrushStyle newBrushStyle);
     void setShape(const Shape newShape);
 
-    void moveHistory(int x);
+    bool moveHistory(int x);
 
     bool isModified() const { return modified; }
     QColor penColor() const { return myPenColor; }
     QColor brushColor() const { return myBrushColor; }
     int penWidth() const { return myPenWidth; }
+    int fillTolerance() const { return myFillTolerance; }
+    void setFillTolerance(int tolerance) { myFillTolerance = tolerance; }
     Qt::PenStyle penStyle() const { return myPenStyle; }
     Qt::BrushStyle brushStyle() const { return myBrushStyle; }
     Shape shape() const { return myShape; }
 
     void copySelectedImage();
     void clearSelected(bool clearArea);
-    void togglePasting() { pasting = !pasting; }
+    void pasteClipboard();
 
 public slots:
     void clearImage();
     void print();
+    void setVectorMode(bool enabled);
+    void setSmoothStrokes(bool enabled);
+    void setAdaptivePreview(bool enabled);
+    void addLayer();
+    void removeLayer();
+    void setCurrentLayer(int i);
+    void raiseLayer();
+    void lowerLayer();
+    void setLayerOpacity(int percent);
+    void setLayerVisible(bool visible);
+    void setLayerBlendMode(int mode);
+    void setZoom(qreal factor);
+    void setZoom(qreal factor, const QPoint &anchor);
+
+signals:
+    void repaintRateChanged(qint64 pixelsPerSecond);
+    void saveProgress(int percent);
+    void saveFinished(const QString &fileName, bool ok);
+    void loadFinished(const QString &fileName, bool ok);
+    void vectorModeChanged(bool enabled);
+    void layersChanged();
+    void zoomChanged(qreal factor);
+    void firstFramePainted();
 
 protected:
     void mousePressEvent(QMouseEvent *event);
@@ -48,31 +104,107 @@ protected:
     void mouseReleaseEvent(QMouseEvent *event);
     void paintEvent(QPaintEvent *event);
     void resizeEvent(QResizeEvent *event);
+    void wheelEvent(QWheelEvent *event);
+    void keyPressEvent(QKeyEvent *event);
+
+private slots:
+    void reportRepaintRate();
+    void flushStroke();
+    void takeRenderedTiles();
+    void reapSaves();
+    void takeLoadedBands();
+    void finishLoad();
 
 private:
+    bool openDocument(const QString &fileName);
+    bool saveDocument(const QString &fileName);
     void drawShape(const QPoint endPoint, const Shape);
-    void resizeImage(QImage *image, const QSize &newSize);
+    void drawStroke(bool final);
+    QPolygon splineSegment(int i) const;
+    void touchHistory(const QRect &rect);
+    void commitCommand(const DrawCommand &command);
+    void finishCommand(const DrawCommand &command);
+    DrawCommand shapeCommand(const QPoint startPoint, const QPoint endPoint,
+                             const Shape) const;
+    QRect selectionRect() const;
+    DrawCommand clearCommand(const QRect &rect) const;
+    const TiledCanvas &shownCanvas();
+    DrawCommand previewCommand(DrawCommand command) const;
+    void finishSave(ImageSaver *saver);
+    void cancelLoad();
+    void syncRender();
+    void syncJournal();
+    void prepareLayerSwitch();
+    void resetHistories();
+    ImageHistory *createHistory() const;
+    void finishLayerEdit(bool switched);
+    void moveLayer(int to);
+    void recordLayer();
+    void liftSelection();
+    void commitFloating(bool keepPixels);
+    void cancelFloating();
+    void panBy(const QPoint &delta);
+    QPoint toCanvas(const QPoint &pos) const;
+    QRect toCanvas(const QRect &rect) const;
+    QRect toWidget(const QRect &rect) const;
+    void updateCanvas(const QRect &rect);
 
     bool modified;
     bool selected;
     bool scribbling;
-    bool pasting;
+    bool vectorMode;
+    bool commitPending;
+    bool smoothStrokes;
+    bool adaptivePreview;
+    bool cheapPreview;
     int myPenWidth;
+    int myFillTolerance;
 
     QColor myPenColor;
     QColor myBrushColor;
     Qt::PenStyle myPenStyle;
     Qt::BrushStyle myBrushStyle;
     QPoint lastPoint;
+    QPoint previewPoint;
+    QPoint panStart;
+    QPoint origin;
+    qreal zoom;
+    DrawCommand stroke;
+    QPolygon strokeInput;
+    int strokeDrawn;
+    QTimer flushTimer;
     QPoint* polyPoints;
 
-    QImage image;
-    QImage selectedImage;
+    TiledCanvas canvas;
+    TiledCanvas liftedCanvas;       // canvas with the lifted pixels' source cleared
+    QRect liftedSource;
+    QList<qint64> liftedKeys;       // source tiles the cleared ones were made from
+    QList<QImage> liftedTiles;
+    LayerStack layers;
+    MipmapCache mipmaps;
     QRect  selectedArea;
-    QList<QImage> imageHistory;
-    int idxHistory;
+    FloatingSelection floating;
+    enum FloatDrag { NoFloatDrag, MoveFloat, ScaleFloat, RotateFloat } floatDrag;
+    QPoint floatStart;
+    QPoint floatStartPos;
+    qreal floatStartScale;
+    qreal floatStartAngle;
+    QList<ImageHistory *> histories;    // one per layer, in stacking order
+    ImageHistory *history;              // the current layer's
+    qint64 myHistoryBudget;
+    VectorDocument document;
+    QList<ImageSaver *> savers;
+    ScribbleFile nativeFile;
+    ImageLoader *loader;
+    Journal *journal;
+    RenderQueue *renderer;
+    QPointer<PrintJob> printJob;
 
     Shape myShape;
+
+    qint64 repaintedPixels;
+    bool framePainted;
+    QElapsedTimer repaintTimer;
 };
 
 #endif
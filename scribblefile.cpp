@@ -0,0 +1,351 @@
+#include <QDataStream>
+#include <QFileInfo>
+#include <QSet>
+#include <cstring>
+#include "common.h"
+#include "profiler.h"
+#include "scribblefile.h"
+#include "tiledcanvas.h"
+
+static const quint32 ScribbleMagic = 0x53435242; // "SCRB"
+static const quint32 ScribbleVersion = 3;
+static const int HeaderSize = 24;
+
+ScribbleFile::ScribbleFile()
+    : myCurrent(0), garbage(0), myIndexOffset(0), myFileSize(0), map(0)
+{
+}
+
+ScribbleFile::~ScribbleFile()
+{
+    close();
+}
+
+bool ScribbleFile::canRead(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    // Version 1 files hold a single layer, version 2 ones no paper flag;
+    // both are still read.
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    return magic == ScribbleMagic && version >= 1 && version <= ScribbleVersion;
+}
+
+bool ScribbleFile::open(const QString &fileName)
+{
+    close();
+    myFileName = fileName;
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly) || !readIndex()) {
+        close();
+        return false;
+    }
+
+    map = file.map(0, file.size());
+    if (!map) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ScribbleFile::close()
+{
+    if (map)
+        file.unmap(map);
+    map = 0;
+    file.close();
+}
+
+bool ScribbleFile::readIndex()
+{
+    QDataStream in(&file);
+    quint32 magic, version;
+    qint64 indexOffset;
+    in >> magic >> version >> mySize >> indexOffset;
+    if (magic != ScribbleMagic || version < 1 || version > ScribbleVersion
+            || indexOffset < HeaderSize || indexOffset >= file.size())
+        return false;
+
+    rememberDisk(indexOffset);
+    file.seek(indexOffset);
+    myLayers.clear();
+    index.clear();
+    myCurrent = 0;
+    if (version == 1) {
+        Layer layer;
+        layer.name = QObject::tr("Background");
+        layer.paper = true;
+        myLayers << layer;
+        index << QHash<quint32, Entry>();
+        if (!readTileIndex(in, indexOffset, &index.last()))
+            return false;
+    } else {
+        qint32 count, current;
+        in >> count >> current;
+        if (in.status() != QDataStream::Ok || count < 1 || current < 0 || current >= count)
+            return false;
+        myCurrent = current;
+
+        for (qint32 i = 0; i < count; ++i) {
+            Layer layer;
+            double opacity;
+            qint32 mode;
+            in >> layer.name >> opacity >> layer.visible >> mode;
+            if (version >= 3)
+                in >> layer.paper;
+            layer.opacity = opacity;
+            layer.mode = QPainter::CompositionMode(mode);
+            myLayers << layer;
+            index << QHash<quint32, Entry>();
+            if (!readTileIndex(in, indexOffset, &index.last()))
+                return false;
+        }
+    }
+
+    countGarbage(indexOffset);
+    return in.status() == QDataStream::Ok;
+}
+
+bool ScribbleFile::readTileIndex(QDataStream &in, qint64 indexOffset, QHash<quint32, Entry> *tiles)
+{
+    qint32 count;
+    in >> count;
+    for (qint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        qint32 tx, ty;
+        Entry entry;
+        in >> tx >> ty >> entry.offset >> entry.length;
+        entry.cacheKey = 0;
+        if (entry.offset < HeaderSize || entry.offset + entry.length > indexOffset)
+            return false;
+        tiles->insert(TiledCanvas::tileKey(tx, ty), entry);
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+void ScribbleFile::countGarbage(qint64 indexOffset)
+{
+    // Everything between the header and the index that no entry points
+    // to; a blob shared by several layers counts once.
+    garbage = indexOffset - HeaderSize;
+    QSet<qint64> counted;
+    for (int i = 0; i < index.size(); ++i) {
+        foreach (const Entry &entry, index[i]) {
+            if (counted.contains(entry.offset))
+                continue;
+            counted.insert(entry.offset);
+            garbage -= entry.length;
+        }
+    }
+}
+
+QList<Layer> ScribbleFile::layers() const
+{
+    // Only the settings; the tiles are read with tile().
+    QList<Layer> result = myLayers;
+    for (int i = 0; i < result.size(); ++i) {
+        result[i].canvas.setTransparent(i > 0);
+        result[i].canvas.resize(mySize);
+    }
+    return result;
+}
+
+QList<QPoint> ScribbleFile::tiles(int layer) const
+{
+    QList<QPoint> positions;
+    if (layer < 0 || layer >= index.size())
+        return positions;
+
+    QHash<quint32, Entry>::const_iterator it;
+    for (it = index[layer].constBegin(); it != index[layer].constEnd(); ++it)
+        positions << QPoint(qint16(it.key() & 0xffff), qint16(it.key() >> 16));
+    return positions;
+}
+
+QImage ScribbleFile::tile(int layer, int tx, int ty) const
+{
+    PROFILE_SCOPE("scribblefile.tile");
+    if (!map || layer < 0 || layer >= index.size())
+        return QImage();
+    QHash<quint32, Entry>::const_iterator it = index[layer].constFind(TiledCanvas::tileKey(tx, ty));
+    if (it == index[layer].constEnd())
+        return QImage();
+
+    QByteArray data = qUncompress(map + it.value().offset, it.value().length);
+    QImage image(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+    if (data.size() != image.byteCount())
+        return QImage();
+    memcpy(image.bits(), data.constData(), data.size());
+    return image;
+}
+
+void ScribbleFile::markClean(const QList<Layer> &layers)
+{
+    for (int i = 0; i < index.size(); ++i) {
+        QHash<quint32, Entry>::iterator it;
+        for (it = index[i].begin(); it != index[i].end(); ++it) {
+            QPoint pos(qint16(it.key() & 0xffff), qint16(it.key() >> 16));
+            it.value().cacheKey = i < layers.size()
+                                  ? layers[i].canvas.tile(pos.x(), pos.y()).cacheKey() : 0;
+        }
+    }
+}
+
+bool ScribbleFile::save(const QList<Layer> &layers, int current, const QString &fileName)
+{
+    PROFILE_SCOPE("scribblefile.save");
+    close();
+    if (layers.isEmpty())
+        return false;
+
+    // Rewrite from scratch once more than half of the file is dead tiles.
+    bool append = fileName == myFileName && unchangedOnDisk(fileName)
+                  && garbage * 2 < myFileSize;
+    if (append) {
+        file.setFileName(fileName);
+        if (file.open(QIODevice::ReadWrite) && writeTiles(layers, current, true)) {
+            file.close();
+            rememberDisk(myIndexOffset);
+            return true;
+        }
+        file.close();
+    }
+
+    index.clear();
+    myLayers.clear();
+    garbage = 0;
+    file.setFileName(fileName + ".new");
+    bool ok = file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+              && writeTiles(layers, current, false);
+    file.close();
+
+    ok = ok && (!QFile::exists(fileName) || QFile::remove(fileName))
+         && QFile::rename(fileName + ".new", fileName);
+    if (!ok) {
+        QFile::remove(fileName + ".new");
+        index.clear();
+        myLayers.clear();
+        myFileName.clear();
+        return false;
+    }
+
+    myFileName = fileName;
+    rememberDisk(myIndexOffset);
+    return true;
+}
+
+bool ScribbleFile::unchangedOnDisk(const QString &fileName) const
+{
+    // Someone else may have rewritten the file since; appending would then
+    // point the new index at blobs that are not there.
+    QFileInfo info(fileName);
+    if (!info.exists() || info.size() != myFileSize || info.lastModified() != myModified)
+        return false;
+
+    QFile check(fileName);
+    if (!check.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream in(&check);
+    quint32 magic, version;
+    QSize size;
+    qint64 indexOffset;
+    in >> magic >> version >> size >> indexOffset;
+    return in.status() == QDataStream::Ok && magic == ScribbleMagic
+           && version >= 1 && version <= ScribbleVersion && indexOffset == myIndexOffset;
+}
+
+void ScribbleFile::rememberDisk(qint64 indexOffset)
+{
+    QFileInfo info(myFileName);
+    myIndexOffset = indexOffset;
+    myFileSize = info.size();
+    myModified = info.lastModified();
+}
+
+bool ScribbleFile::writeTiles(const QList<Layer> &layers, int current, bool append)
+{
+    QDataStream out(&file);
+    if (append) {
+        file.seek(file.size());
+    } else {
+        // Placeholder header; the real one is written once the index is out.
+        out << quint32(0) << quint32(0) << QSize() << qint64(0);
+    }
+
+    // Blobs already in the file, by the tile they hold, so unchanged tiles
+    // are not written again even when their layer moved.
+    QHash<qint64, Entry> blobs;
+    for (int i = 0; i < index.size(); ++i)
+        foreach (const Entry &entry, index[i])
+            if (entry.cacheKey)
+                blobs.insert(entry.cacheKey, entry);
+
+    QList<QHash<quint32, Entry> > written;
+    QSize size = layers.at(current).canvas.size();
+    for (int i = 0; i < layers.size(); ++i) {
+        const TiledCanvas &canvas = layers[i].canvas;
+        written << QHash<quint32, Entry>();
+        for (int ty = 0; ty * TILE_SIZE < size.height(); ++ty) {
+            for (int tx = 0; tx * TILE_SIZE < size.width(); ++tx) {
+                QImage image = canvas.tile(tx, ty);
+                if (image.isNull())
+                    continue;
+
+                QHash<qint64, Entry>::const_iterator it = blobs.constFind(image.cacheKey());
+                if (it != blobs.constEnd()) {
+                    written[i].insert(TiledCanvas::tileKey(tx, ty), it.value());
+                    continue;
+                }
+
+                QByteArray packed = qCompress(image.constBits(), image.byteCount(), 1);
+                Entry entry;
+                entry.offset = file.pos();
+                entry.length = packed.size();
+                entry.cacheKey = image.cacheKey();
+                if (file.write(packed) != packed.size())
+                    return false;
+                written[i].insert(TiledCanvas::tileKey(tx, ty), entry);
+                blobs.insert(entry.cacheKey, entry);
+            }
+        }
+    }
+
+    qint64 indexOffset = file.pos();
+    out << qint32(layers.size()) << qint32(current);
+    for (int i = 0; i < layers.size(); ++i) {
+        const Layer &layer = layers[i];
+        out << layer.name << double(layer.opacity) << layer.visible << qint32(layer.mode)
+            << layer.paper;
+        out << qint32(written[i].size());
+        QHash<quint32, Entry>::const_iterator it;
+        for (it = written[i].constBegin(); it != written[i].constEnd(); ++it)
+            out << qint32(qint16(it.key() & 0xffff)) << qint32(qint16(it.key() >> 16))
+                << it.value().offset << it.value().length;
+    }
+    if (out.status() != QDataStream::Ok || !file.flush())
+        return false;
+
+    // Switching the header over is the single write that commits the save.
+    file.seek(0);
+    out << ScribbleMagic << ScribbleVersion << size << indexOffset;
+    if (out.status() != QDataStream::Ok || !file.flush())
+        return false;
+
+    // Blobs of tiles that changed or went back to white, and old indexes.
+    index = written;
+    myLayers.clear();
+    for (int i = 0; i < layers.size(); ++i) {
+        Layer layer = layers[i];
+        layer.canvas = TiledCanvas();
+        myLayers << layer;
+    }
+    myCurrent = current;
+    mySize = size;
+    myIndexOffset = indexOffset;
+    countGarbage(indexOffset);
+    return true;
+}
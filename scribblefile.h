@@ -0,0 +1,79 @@
+#ifndef SCRIBBLEFILE_H
+#define SCRIBBLEFILE_H
+
+#include <QDateTime>
+#include <QFile>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QPoint>
+#include <QSize>
+#include <QString>
+
+#include "layerstack.h"
+
+class QDataStream;
+
+/*
+ * Native .scribble file: a header, one zlib-compressed blob per allocated
+ * tile and an index that lists every layer with its name, opacity,
+ * visibility and blend mode, and where each of its tiles lives. Layers
+ * that share a tile share its blob. Reading maps the file and only
+ * decompresses the tiles asked for. Saving over the file that was last
+ * opened or saved appends the tiles that changed since, followed by a new
+ * index; the header is switched to it last, so an interrupted save leaves
+ * the previous version intact. The file is only appended to while its
+ * header, size and modification time are the ones last seen; otherwise
+ * it is written from scratch.
+ */
+class ScribbleFile
+{
+public:
+    ScribbleFile();
+    ~ScribbleFile();
+
+    static bool canRead(const QString &fileName);
+
+    bool open(const QString &fileName);
+    void close();
+    QString fileName() const { return myFileName; }
+    QSize size() const { return mySize; }
+    int layerCount() const { return myLayers.size(); }
+    int currentLayer() const { return myCurrent; }
+    QList<Layer> layers() const;
+    QList<QPoint> tiles(int layer) const;
+    QImage tile(int layer, int tx, int ty) const;
+
+    void markClean(const QList<Layer> &layers);
+    bool save(const QList<Layer> &layers, int current, const QString &fileName);
+
+private:
+    struct Entry
+    {
+        qint64 offset;
+        qint32 length;
+        qint64 cacheKey;
+    };
+
+    bool readIndex();
+    bool readTileIndex(QDataStream &in, qint64 indexOffset, QHash<quint32, Entry> *tiles);
+    bool writeTiles(const QList<Layer> &layers, int current, bool append);
+    bool unchangedOnDisk(const QString &fileName) const;
+    void rememberDisk(qint64 indexOffset);
+    void countGarbage(qint64 indexOffset);
+
+    QString myFileName;
+    QSize mySize;
+    QList<Layer> myLayers;
+    int myCurrent;
+    QList<QHash<quint32, Entry> > index;
+    qint64 garbage;
+    qint64 myIndexOffset;
+    qint64 myFileSize;
+    QDateTime myModified;
+
+    QFile file;
+    uchar *map;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include <QElapsedTimer>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QTextStream>
+#include <cstdio>
+#include "startupprofile.h"
+
+static QElapsedTimer startupClock;
+static bool enabled = false;
+static bool reported = false;
+static qint64 lastMark = 0;
+static QList<QPair<const char *, qint64> > phases;
+
+void StartupProfile::start()
+{
+    startupClock.start();
+}
+
+void StartupProfile::setEnabled(bool on)
+{
+    enabled = on;
+}
+
+void StartupProfile::mark(const char *phase)
+{
+    if (!enabled || reported)
+        return;
+    qint64 now = startupClock.nsecsElapsed();
+    phases << qMakePair(phase, now - lastMark);
+    lastMark = now;
+}
+
+void StartupProfile::firstFrame()
+{
+    if (!enabled || reported)
+        return;
+    mark("first frame");
+    reported = true;
+
+    QTextStream err(stderr);
+    foreach (const QPair<const char *, qint64> &phase, phases)
+        err << QString("%1 %2 ms\n").arg(phase.first, -24).arg(phase.second / 1e6, 8, 'f', 2);
+    err << QString("%1 %2 ms\n").arg("time to first frame", -24).arg(lastMark / 1e6, 8, 'f', 2);
+}
@@ -0,0 +1,20 @@
+#ifndef STARTUPPROFILE_H
+#define STARTUPPROFILE_H
+
+/*
+ * Wall-clock time of each step of starting up, from main() to the first
+ * frame of the canvas. With --profile-startup the steps are printed to
+ * stderr once that frame is painted; otherwise mark() does nothing.
+ * Unlike the PROFILE_ macros this works in every build, so the release
+ * binary can be measured.
+ */
+class StartupProfile
+{
+public:
+    static void start();
+    static void setEnabled(bool enabled);
+    static void mark(const char *phase);
+    static void firstFrame();
+};
+
+#endif
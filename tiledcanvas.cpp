@@ -0,0 +1,243 @@
+#include <QFontDatabase>
+#include <QPainter>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrentMap>
+#include "kernels.h"
+#include "profiler.h"
+#include "tiledcanvas.h"
+
+// Commands covering fewer tiles than this are not worth a thread hop.
+static const int ParallelTiles = 8;
+
+namespace {
+
+struct TileJob
+{
+    QImage *tile;
+    int tx;
+    int ty;
+};
+
+struct TilePainter
+{
+    typedef void result_type;
+
+    TilePainter(const DrawCommand &command, const QRect &area, bool transparent)
+        : command(command), area(area), transparent(transparent) {}
+
+    void operator()(TileJob &job) const
+    {
+        TiledCanvas::paintTile(job.tile, job.tx, job.ty, command, area, transparent);
+    }
+
+    const DrawCommand &command;
+    QRect area;
+    bool transparent;
+};
+
+}
+
+TiledCanvas::TiledCanvas()
+{
+    transparent = false;
+}
+
+void TiledCanvas::resize(const QSize &newSize)
+{
+    mySize = newSize;
+}
+
+void TiledCanvas::clear()
+{
+    tiles.clear();
+}
+
+QRect TiledCanvas::paint(const DrawCommand &command, const QRect &clip, bool parallel)
+{
+    QRect area = command.boundingRect().intersected(rect());
+    if (!clip.isNull())
+        area &= clip;
+    if (area.isEmpty())
+        return area;
+
+    // Tiles are allocated here; the hash must not change while they are painted.
+    QVector<TileJob> jobs;
+    for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+        for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+            TileJob job;
+            job.tile = &tiles[tileKey(tx, ty)];
+            job.tx = tx;
+            job.ty = ty;
+            jobs << job;
+        }
+    }
+
+    // Every tile gets its own painter and clip, so splitting the work
+    // across threads gives the same pixels as painting them in order.
+    TilePainter painter(command, area, transparent);
+    if (command.shape == TEXT && !QFontDatabase::supportsThreadedFontRendering())
+        parallel = false;
+    if (parallel && jobs.size() >= ParallelTiles
+            && QThreadPool::globalInstance()->maxThreadCount() > 1) {
+        PROFILE_SCOPE("canvas.parallelPaint");
+        QtConcurrent::blockingMap(jobs, painter);
+    } else {
+        for (int i = 0; i < jobs.size(); ++i)
+            painter(jobs[i]);
+    }
+
+    return area;
+}
+
+void TiledCanvas::paintTile(QImage *tile, int tx, int ty, const DrawCommand &command,
+                            const QRect &area, bool transparent)
+{
+    if (tile->isNull()) {
+        *tile = QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        tile->fill(transparent ? 0 : qRgb(255, 255, 255));
+    }
+
+    if (paintFast(tile, tx, ty, command, area))
+        return;
+
+    QPainter painter(tile);
+    painter.translate(-tx * TILE_SIZE, -ty * TILE_SIZE);
+    painter.setClipRect(area);
+    command.paint(&painter);
+}
+
+bool TiledCanvas::paintFast(QImage *tile, int tx, int ty, const DrawCommand &command,
+                            const QRect &area)
+{
+    QRect clip = tileRect(tx, ty) & area;
+    QPoint origin = tileRect(tx, ty).topLeft();
+
+    if (command.shape == PASTE && !command.points.isEmpty()) {
+        const QImage &image = command.image;
+        bool opaque = image.format() == QImage::Format_RGB32;
+        if (!opaque && image.format() != QImage::Format_ARGB32_Premultiplied)
+            return false;
+
+        QRect target = clip & QRect(command.points.first(), image.size());
+        QPoint offset = target.topLeft() - command.points.first();
+        for (int y = 0; y < target.height(); ++y) {
+            quint32 *dst = reinterpret_cast<quint32 *>(tile->scanLine(target.top() - origin.y() + y))
+                           + target.left() - origin.x();
+            const quint32 *src = reinterpret_cast<const quint32 *>(image.constScanLine(offset.y() + y))
+                                 + offset.x();
+            if (opaque)
+                Kernels::copy(dst, src, target.width());
+            else
+                Kernels::blend(dst, src, target.width());
+        }
+        return true;
+    }
+
+    // Opaque fills set the pixels under the mask, a run at a time.
+    if (command.shape == FILL && !command.points.isEmpty()
+            && command.image.format() == QImage::Format_Mono
+            && command.brush.color().alpha() == 255) {
+        QPoint anchor = command.points.first();
+        QRect target = clip & QRect(anchor, command.image.size());
+        quint32 color = command.brush.color().rgba();
+        for (int y = target.top(); y <= target.bottom(); ++y) {
+            const uchar *mask = command.image.constScanLine(y - anchor.y());
+            quint32 *line = reinterpret_cast<quint32 *>(tile->scanLine(y - origin.y()));
+            int x = target.left();
+            while (x <= target.right()) {
+                int mx = x - anchor.x();
+                if (!(mask[mx >> 3] & (0x80 >> (mx & 7)))) {
+                    ++x;
+                    continue;
+                }
+                int start = x;
+                for (++x, ++mx; x <= target.right() && (mask[mx >> 3] & (0x80 >> (mx & 7))); ++x, ++mx)
+                    ;
+                Kernels::fill(line + start - origin.x(), color, x - start);
+            }
+        }
+        return true;
+    }
+
+    // Plain opaque rectangles, such as a cleared selection, are a fill;
+    // fully transparent ones clear to transparent.
+    int alpha = command.brush.color().alpha();
+    if (command.shape == RECT && command.points.size() >= 2
+            && command.pen.style() == Qt::NoPen
+            && command.brush.style() == Qt::SolidPattern
+            && (alpha == 255 || alpha == 0)) {
+        QRect rect(command.points.first(), command.points.last());
+        if (!rect.isValid())
+            return false;
+
+        QRect target = clip & rect;
+        quint32 color = alpha ? command.brush.color().rgba() : 0;
+        for (int y = target.top(); y <= target.bottom(); ++y)
+            Kernels::fill(reinterpret_cast<quint32 *>(tile->scanLine(y - origin.y()))
+                          + target.left() - origin.x(),
+                          color, target.width());
+        return true;
+    }
+
+    return false;
+}
+
+void TiledCanvas::draw(QPainter *painter, const QRect &rect) const
+{
+    QRect area = rect.intersected(this->rect());
+
+    if (!area.isEmpty()) {
+        for (int ty = area.top() / TILE_SIZE; ty <= area.bottom() / TILE_SIZE; ++ty) {
+            for (int tx = area.left() / TILE_SIZE; tx <= area.right() / TILE_SIZE; ++tx) {
+                QRect target = tileRect(tx, ty).intersected(area);
+                QHash<quint32, QImage>::const_iterator it = tiles.constFind(tileKey(tx, ty));
+                if (it == tiles.constEnd()) {
+                    if (!transparent)
+                        painter->fillRect(target, Qt::white);
+                } else {
+                    painter->drawImage(target, it.value(),
+                                       target.translated(-tx * TILE_SIZE, -ty * TILE_SIZE));
+                }
+            }
+        }
+    }
+
+    // Whatever lies outside the canvas is shown as blank paper too.
+    if (transparent)
+        return;
+    QRegion outside = QRegion(rect) - QRegion(area);
+    foreach (const QRect &r, outside.rects())
+        painter->fillRect(r, Qt::white);
+}
+
+QImage TiledCanvas::copy(const QRect &rect) const
+{
+    QImage result(rect.size(), QImage::Format_ARGB32_Premultiplied);
+    if (result.isNull())
+        return result;
+    if (transparent)
+        result.fill(0);
+
+    if (rect.contains(this->rect()))
+        PROFILE_COUNT("canvas copies", 1);
+
+    QPainter painter(&result);
+    painter.translate(-rect.topLeft());
+    draw(&painter, rect);
+    painter.end();
+    return result;
+}
+
+QImage TiledCanvas::tile(int tx, int ty) const
+{
+    return tiles.value(tileKey(tx, ty));
+}
+
+void TiledCanvas::setTile(int tx, int ty, const QImage &tile)
+{
+    if (tile.isNull())
+        tiles.remove(tileKey(tx, ty));
+    else
+        tiles.insert(tileKey(tx, ty), tile);
+}
@@ -0,0 +1,63 @@
+#ifndef TILEDCANVAS_H
+#define TILEDCANVAS_H
+
+#include <QHash>
+#include <QImage>
+#include <QRect>
+#include <QSize>
+
+#include "common.h"
+#include "drawcommand.h"
+
+class QPainter;
+
+/*
+ * Sparse canvas made of TILE_SIZE x TILE_SIZE tiles. A tile is allocated
+ * the first time something is painted on it; missing tiles are white,
+ * or transparent for a canvas that is stacked over others. Resizing only
+ * moves the canvas bounds, no pixels are copied.
+ *
+ * paint() splits large commands across the thread pool unless told not
+ * to; text stays on the calling thread where fonts are not thread-safe.
+ */
+class TiledCanvas
+{
+public:
+    TiledCanvas();
+
+    QSize size() const { return mySize; }
+    int width() const { return mySize.width(); }
+    int height() const { return mySize.height(); }
+    QRect rect() const { return QRect(QPoint(0, 0), mySize); }
+
+    void resize(const QSize &newSize);
+    void clear();
+    bool isTransparent() const { return transparent; }
+    void setTransparent(bool enabled) { transparent = enabled; }
+
+    QRect paint(const DrawCommand &command, const QRect &clip = QRect(), bool parallel = true);
+    void draw(QPainter *painter, const QRect &rect) const;
+    QImage copy(const QRect &rect) const;
+    QImage toImage() const { return copy(rect()); }
+
+    QImage tile(int tx, int ty) const;
+    void setTile(int tx, int ty, const QImage &tile);
+    int tileCount() const { return tiles.size(); }
+
+    static void paintTile(QImage *tile, int tx, int ty, const DrawCommand &command,
+                          const QRect &area, bool transparent);
+    static QRect tileRect(int tx, int ty)
+    { return QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE); }
+    static quint32 tileKey(int tx, int ty)
+    { return (quint32(ty & 0xffff) << 16) | quint32(tx & 0xffff); }
+
+private:
+    static bool paintFast(QImage *tile, int tx, int ty, const DrawCommand &command,
+                          const QRect &area);
+
+    QHash<quint32, QImage> tiles;
+    QSize mySize;
+    bool transparent;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include <QDataStream>
+#include <QIODevice>
+#include <QtAlgorithms>
+#include <algorithm>
+#include "vectordocument.h"
+
+static const quint32 VectorMagic = 0x53435256; // "SCRV"
+static const quint32 VectorVersion = 1;
+
+// A paste blends over what is already there; clearing the area first
+// makes it replace the pixels, which matters on transparent layers.
+static void replaceArea(TiledCanvas *canvas, const QRect &area, const QImage &image)
+{
+    DrawCommand clear(RECT);
+    clear.brush = QBrush(Qt::transparent);
+    clear.points << area.topLeft() << area.bottomRight();
+    canvas->paint(clear, area);
+
+    DrawCommand base(PASTE);
+    base.points << area.topLeft();
+    base.image = image;
+    canvas->paint(base, area);
+}
+
+VectorDocument::VectorDocument()
+{
+    visible = 0;
+}
+
+void VectorDocument::clear()
+{
+    background = TiledCanvas();
+    items.clear();
+    bounds.clear();
+    cells.clear();
+    visible = 0;
+}
+
+void VectorDocument::setBackground(const TiledCanvas &canvas)
+{
+    background = canvas;
+}
+
+void VectorDocument::add(const DrawCommand &command)
+{
+    while (items.size() > visible) {
+        index(items.size() - 1, false);
+        items.removeLast();
+        bounds.removeLast();
+    }
+
+    items.append(command);
+    bounds.append(command.boundingRect());
+    index(items.size() - 1, true);
+    visible++;
+}
+
+QRect VectorDocument::move(TiledCanvas *canvas, int x)
+{
+    QRect rect;
+    if ( (visible + x) < 0 || (visible + x) > items.size() )
+        return rect;
+
+    // Hidden items leave a hole that is rebuilt from what lies under it.
+    for (; x < 0; ++x)
+        rect |= bounds.at(--visible);
+    render(canvas, rect);
+
+    for (; x > 0; --x)
+        rect |= canvas->paint(items.at(visible++));
+
+    return rect;
+}
+
+void VectorDocument::render(TiledCanvas *canvas, const QRect &rect) const
+{
+    QRect area = rect.intersected(canvas->rect());
+    if (area.isEmpty())
+        return;
+
+    replaceArea(canvas, area, background.copy(area));
+
+    foreach (int i, itemsIn(area))
+        canvas->paint(items.at(i), area);
+}
+
+QList<int> VectorDocument::itemsIn(const QRect &rect) const
+{
+    QList<int> result;
+    QRect area = rect.normalized();
+    if (area.isEmpty())
+        return result;
+
+    for (int cy = qMax(area.top(), 0) / TILE_SIZE; cy <= qMax(area.bottom(), 0) / TILE_SIZE; ++cy) {
+        for (int cx = qMax(area.left(), 0) / TILE_SIZE; cx <= qMax(area.right(), 0) / TILE_SIZE; ++cx) {
+            QHash<quint32, QList<int> >::const_iterator it = cells.constFind(cellKey(cx, cy));
+            if (it == cells.constEnd())
+                continue;
+            foreach (int i, it.value()) {
+                if (i < visible && bounds.at(i).intersects(area))
+                    result << i;
+            }
+        }
+    }
+
+    // Items spanning several cells show up once per cell.
+    qSort(result);
+    QList<int>::iterator end = std::unique(result.begin(), result.end());
+    result.erase(end, result.end());
+    return result;
+}
+
+int VectorDocument::itemAt(const QPoint &pos) const
+{
+    QList<int> candidates = itemsIn(QRect(pos, QSize(1, 1)));
+    for (int j = candidates.size() - 1; j >= 0; --j) {
+        if (items.at(candidates.at(j)).contains(pos))
+            return candidates.at(j);
+    }
+    return -1;
+}
+
+Item VectorDocument::itemType(int i) const
+{
+    switch (items.at(i).shape)
+    {
+        case LINE:
+            return LineItem;
+        case RECT:
+        case ROUNDRECT:
+            return RectItem;
+        case ELLIPSE:
+            return EllipseItem;
+        case POLYGON:
+            return PolygonItem;
+        case TEXT:
+            return TextItem;
+        case PASTE:
+            return PixmapItem;
+        default:
+            return PathItem;
+    }
+}
+
+void VectorDocument::index(int i, bool insert)
+{
+    QRect area = bounds.at(i);
+    if (area.isEmpty())
+        return;
+
+    for (int cy = qMax(area.top(), 0) / TILE_SIZE; cy <= qMax(area.bottom(), 0) / TILE_SIZE; ++cy) {
+        for (int cx = qMax(area.left(), 0) / TILE_SIZE; cx <= qMax(area.right(), 0) / TILE_SIZE; ++cx) {
+            // Items are added and removed in order, so each cell list is a stack.
+            if (insert) {
+                cells[cellKey(cx, cy)].append(i);
+            } else {
+                QList<int> &cell = cells[cellKey(cx, cy)];
+                if (!cell.isEmpty() && cell.last() == i)
+                    cell.removeLast();
+                if (cell.isEmpty())
+                    cells.remove(cellKey(cx, cy));
+            }
+        }
+    }
+}
+
+bool VectorDocument::save(QIODevice *device, const QSize &size) const
+{
+    QDataStream out(device);
+    out.setVersion(QDataStream::Qt_4_6);
+
+    out << VectorMagic << VectorVersion << size;
+    out << bool(background.tileCount() > 0);
+    if (background.tileCount() > 0)
+        out << background.toImage();
+
+    out << qint32(visible);
+    for (int i = 0; i < visible; ++i)
+        out << items.at(i);
+
+    return out.status() == QDataStream::Ok;
+}
+
+bool VectorDocument::load(QIODevice *device, QSize *size)
+{
+    QDataStream in(device);
+    in.setVersion(QDataStream::Qt_4_6);
+
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != VectorMagic || version != VectorVersion)
+        return false;
+
+    clear();
+    in >> *size;
+    background.resize(*size);
+
+    bool hasBackground;
+    in >> hasBackground;
+    if (hasBackground) {
+        QImage image;
+        in >> image;
+        replaceArea(&background, QRect(QPoint(0, 0), image.size()),
+                    image.convertToFormat(QImage::Format_ARGB32_Premultiplied));
+    }
+
+    qint32 count;
+    in >> count;
+    for (qint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        DrawCommand command;
+        in >> command;
+        add(command);
+    }
+
+    return in.status() == QDataStream::Ok;
+}
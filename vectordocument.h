@@ -0,0 +1,53 @@
+#ifndef VECTORDOCUMENT_H
+#define VECTORDOCUMENT_H
+
+#include <QHash>
+#include <QList>
+#include <QRect>
+#include <QSize>
+
+#include "drawcommand.h"
+#include "tiledcanvas.h"
+
+class QIODevice;
+
+/*
+ * Retained-mode document: every committed operation is kept as an item
+ * and bucketed into a grid of TILE_SIZE cells, so hit-testing and
+ * re-rendering a region only visit the items overlapping it. Undo and
+ * redo just hide or show the newest items. Whatever was on the canvas
+ * when the document was started is kept as a read-only background.
+ */
+class VectorDocument
+{
+public:
+    VectorDocument();
+
+    void clear();
+    void setBackground(const TiledCanvas &canvas);
+    void add(const DrawCommand &command);
+    QRect move(TiledCanvas *canvas, int x);
+    void render(TiledCanvas *canvas, const QRect &rect) const;
+
+    QList<int> itemsIn(const QRect &rect) const;
+    int itemAt(const QPoint &pos) const;
+    Item itemType(int i) const;
+    const DrawCommand &item(int i) const { return items.at(i); }
+    int count() const { return visible; }
+
+    bool save(QIODevice *device, const QSize &size) const;
+    bool load(QIODevice *device, QSize *size);
+
+private:
+    static quint32 cellKey(int cx, int cy)
+    { return (quint32(cy & 0xffff) << 16) | quint32(cx & 0xffff); }
+    void index(int i, bool insert);
+
+    TiledCanvas background;
+    QList<DrawCommand> items;
+    QList<QRect> bounds;
+    int visible;
+    QHash<quint32, QList<int> > cells;
+};
+
+#endif